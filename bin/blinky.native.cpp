@@ -0,0 +1,183 @@
+// Generated by test/translate.cpp from examples/basics/blinky.bin
+#define WITH_DEBUG
+#define WITH_OPTIMIZER
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include <stdio.h>
+
+#define INSTRUCTION_COUNT 16
+
+#define STEP(position)                 \
+  p->instruction = &p->code[position]; \
+  p->operandCursor = 0;                \
+  p->counter = position + 1;
+
+#define CONTINUE()                     \
+  if (p->delayTime || p->paused)       \
+    return budget;
+
+#define CHARGE(position)               \
+  if (budget-- == 0)                   \
+  {                                    \
+    p->counter = position;             \
+    vm_preempt(p);                     \
+    return 0;                          \
+  }
+
+#define FAST !p->debug
+
+#define RESUME() \
+  CONTINUE();    \
+  goto *labels[p->counter];
+
+static Program program;
+static unsigned char bytes[76] = {
+  0x05, 0x02, 0x01, 0x33, 0x05, 0x0c, 0x00, 0x00, 0x00, 0x43, 0x03, 0x00, 0x02, 0x01, 0x08, 0x05,
+  0xe8, 0x03, 0x00, 0x00, 0x0d, 0x33, 0x05, 0x0c, 0x00, 0x00, 0x00, 0x43, 0x03, 0x00, 0x02, 0x00,
+  0x08, 0x05, 0xe8, 0x03, 0x00, 0x00, 0x0d, 0x33, 0x05, 0x19, 0x00, 0x00, 0x00, 0x0a, 0x04, 0x09,
+  0x00, 0x00, 0x00, 0x0a, 0x04, 0x1b, 0x00, 0x00, 0x00, 0x0a, 0x04, 0x09, 0x00, 0x00, 0x00, 0x0a,
+  0x04, 0x1b, 0x00, 0x00, 0x00, 0x0d, 0x0a, 0x04, 0x2d, 0x00, 0x00, 0x00};
+
+uint native_slice(Program *p, uint budget)
+{
+  static void *labels[] = {
+    &&i0, &&i1, &&i2, &&i3, &&i4, &&i5, &&i6, &&i7,
+    &&i8, &&i9, &&i10, &&i11, &&i12, &&i13, &&i14, &&i15,
+    &&i16};
+
+  goto *labels[p->counter];
+
+i0: // 0
+  CHARGE(0);
+  STEP(0);
+  vm_toggleDebug(p);
+  CONTINUE();
+i1: // 3
+  CHARGE(1);
+  STEP(1);
+  p->counter = _readOperand(p)->number;
+  goto i5;
+i2: // 9
+  CHARGE(2);
+  STEP(2);
+  vm_ioWrite(p);
+  CONTINUE();
+i3: // 14
+  CHARGE(3);
+  STEP(3);
+  vm_delay(p);
+  CONTINUE();
+i4: // 20
+  CHARGE(4);
+  STEP(4);
+  vm_return(p);
+  RESUME();
+i5: // 21
+  CHARGE(5);
+  STEP(5);
+  p->counter = _readOperand(p)->number;
+  goto i9;
+i6: // 27
+  CHARGE(6);
+  STEP(6);
+  vm_ioWrite(p);
+  CONTINUE();
+i7: // 32
+  CHARGE(7);
+  STEP(7);
+  vm_delay(p);
+  CONTINUE();
+i8: // 38
+  CHARGE(8);
+  STEP(8);
+  vm_return(p);
+  RESUME();
+i9: // 39
+  CHARGE(9);
+  STEP(9);
+  p->counter = _readOperand(p)->number;
+  goto i15;
+i10: // 45
+  CHARGE(10);
+  STEP(10);
+  vm_jumpTo(p);
+  CONTINUE();
+  if (p->counter == 2)
+    goto i2;
+i11: // 51
+  CHARGE(11);
+  STEP(11);
+  vm_jumpTo(p);
+  CONTINUE();
+  if (p->counter == 6)
+    goto i6;
+i12: // 57
+  CHARGE(12);
+  STEP(12);
+  vm_jumpTo(p);
+  CONTINUE();
+  if (p->counter == 2)
+    goto i2;
+i13: // 63
+  CHARGE(13);
+  if (FAST)
+    goto i6;
+  STEP(13);
+  vm_goto(p);
+  goto i6;
+i14: // 69
+  CHARGE(14);
+  STEP(14);
+  vm_return(p);
+  RESUME();
+i15: // 70
+  CHARGE(15);
+  STEP(15);
+  vm_jumpTo(p);
+  CONTINUE();
+  if (p->counter == 10)
+    goto i10;
+i16: // 76
+  CHARGE(16);
+  STEP(16);
+  vm_halt(p);
+  return budget;
+}
+
+void native_run(Program *p)
+{
+  uint budget = p->instructionBudget;
+  p->instructionsRun += budget - native_slice(p, budget);
+}
+
+void native_tick(void *p)
+{
+  _tick((Program *)p, &native_run);
+}
+
+bool onSend(char *bytes, int length)
+{
+  fwrite(bytes, 1, length, stdout);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  program.onSend = &onSend;
+  printf("Running examples/basics/blinky.bin\n");
+  program_decode(&program, bytes, sizeof(bytes));
+
+  if (!program.verified || program.instructionCount != INSTRUCTION_COUNT)
+  {
+    printf("Program does not match its translation\n");
+    return -3;
+  }
+
+  os_timer_disarm(&program.timer);
+  os_timer_setfn(&program.timer, &native_tick, &program);
+  os_timer_arm(&program.timer, 1, 0);
+  mock_loop();
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Generated by test/translate.cpp from examples/basics/hello.bin
+#define WITH_DEBUG
+#define WITH_OPTIMIZER
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include <stdio.h>
+
+#define INSTRUCTION_COUNT 1
+
+#define STEP(position)                 \
+  p->instruction = &p->code[position]; \
+  p->operandCursor = 0;                \
+  p->counter = position + 1;
+
+#define CONTINUE()                     \
+  if (p->delayTime || p->paused)       \
+    return budget;
+
+#define CHARGE(position)               \
+  if (budget-- == 0)                   \
+  {                                    \
+    p->counter = position;             \
+    vm_preempt(p);                     \
+    return 0;                          \
+  }
+
+#define FAST !p->debug
+
+#define RESUME() \
+  CONTINUE();    \
+  goto *labels[p->counter];
+
+static Program program;
+static unsigned char bytes[16] = {
+  0x09, 0x07, 0x48, 0x65, 0x6c, 0x6c, 0x6f, 0x2c, 0x20, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0x21, 0x00};
+
+uint native_slice(Program *p, uint budget)
+{
+  static void *labels[] = {
+    &&i0, &&i1};
+
+  goto *labels[p->counter];
+
+i0: // 0
+  CHARGE(0);
+  STEP(0);
+  _printValue(p, _readValue(p));
+  CONTINUE();
+i1: // 16
+  CHARGE(1);
+  STEP(1);
+  vm_halt(p);
+  return budget;
+}
+
+void native_run(Program *p)
+{
+  uint budget = p->instructionBudget;
+  p->instructionsRun += budget - native_slice(p, budget);
+}
+
+void native_tick(void *p)
+{
+  _tick((Program *)p, &native_run);
+}
+
+bool onSend(char *bytes, int length)
+{
+  fwrite(bytes, 1, length, stdout);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  program.onSend = &onSend;
+  printf("Running examples/basics/hello.bin\n");
+  program_decode(&program, bytes, sizeof(bytes));
+
+  if (!program.verified || program.instructionCount != INSTRUCTION_COUNT)
+  {
+    printf("Program does not match its translation\n");
+    return -3;
+  }
+
+  os_timer_disarm(&program.timer);
+  os_timer_setfn(&program.timer, &native_tick, &program);
+  os_timer_arm(&program.timer, 1, 0);
+  mock_loop();
+  return 0;
+}
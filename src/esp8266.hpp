@@ -42,6 +42,47 @@ void os_sleep(uint64_t time)
   system_deep_sleep((uint64_t)time);
 }
 
+// The profiler samples from FRC1, the hardware timer of hw_timer.c in the SDK drivers,
+// so it interrupts the VM in the middle of a tick
+void os_profiler_arm(void (*sample)(), uint32_t interval)
+{
+  hw_timer_init(FRC1_SOURCE, 1);
+  hw_timer_set_func(sample);
+  hw_timer_arm(interval);
+}
+
+void os_profiler_disarm()
+{
+  RTC_REG_WRITE(FRC1_CTRL_ADDRESS, 0);
+}
+
+// The SDK reads and writes flash in words: addresses, buffers and lengths are multiples of 4
+#define FLASH_SECTOR_SIZE SPI_FLASH_SEC_SIZE
+
+bool os_flash_read(uint32_t address, void *data, uint32_t length)
+{
+  return spi_flash_read(address, (uint32 *)data, length) == SPI_FLASH_RESULT_OK;
+}
+
+bool os_flash_write(uint32_t address, const void *data, uint32_t length)
+{
+  return spi_flash_write(address, (uint32 *)data, length) == SPI_FLASH_RESULT_OK;
+}
+
+bool os_flash_erase(uint32_t sector)
+{
+  return spi_flash_erase_sector(sector) == SPI_FLASH_RESULT_OK;
+}
+
+// The first megabyte of flash is mapped by the cache, for reads of aligned words only
+#define os_flash_map(address) ((uint8_t *)(0x40200000 + (address)))
+
+uint8_t os_readByte(const void *address)
+{
+  uint32_t word = *(const uint32_t *)((uint32_t)address & ~3u);
+  return word >> (((uint32_t)address & 3) * 8);
+}
+
 void os_io_allOutput()
 {
   pinType(0, 0);
@@ -1,3 +1,11 @@
 #include "vm_types.hpp"
 #include "vm_opcode.hpp"
 #include "vm_instructions.hpp"
+#include "vm_optimizer.hpp"
+#include "vm_patch.hpp"
+#include "vm_eval.hpp"
+#include "vm_scheduler.hpp"
+#include "vm_upload.hpp"
+#include "vm_store.hpp"
+#include "vm_profiler.hpp"
+#include "vm_trace.hpp"
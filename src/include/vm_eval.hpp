@@ -0,0 +1,213 @@
+#ifdef WITH_EVAL
+
+// Eval: a short fragment of code runs once inside a running program, with its slots,
+// and the program goes on at the same counter after it. A fragment is encoded like the
+// program, with jumps to offsets in the fragment, and ends at its end, on a `halt`,
+// `yield` or `delay`, or on a `return` that was not for one of its calls.
+// It can not set interrupt handlers, which would outlive its code, or write slots that
+// the optimizer replaced with their values
+#ifndef EVAL_BUDGET
+#define EVAL_BUDGET 1000
+#endif
+
+// A transport that is always busy, so the output of a fragment stays in the ring
+bool _holdOutput(char *, int)
+{
+  return false;
+}
+
+// Strings and blobs a fragment left in slots are copied to blocks of the program
+void MOVE_TO_FLASH _keepEvalData(Program *p, byteref fragment, uint length)
+{
+  for (uint i = 0; i < MAX_SLOTS; i++)
+  {
+    Operand operand;
+    EvalData *block;
+    uint size;
+
+    operand.type = p->slots[i].getType();
+    operand.data = p->slots[i].toString();
+
+    if (!_hasData(&operand) || operand.data < fragment || operand.data >= fragment + length)
+      continue;
+
+    size = _dataSize(p, &operand);
+    block = (EvalData *)_allocate(p, sizeof(EvalData) + _wordSize(size));
+    block->next = p->evalData;
+    block->size = size;
+    p->evalData = block;
+    os_memcpy(block + 1, operand.data, size);
+    p->slots[i].update(operand.type, block + 1);
+  }
+}
+
+// Free the blocks of fragments that no slot points into any more
+void MOVE_TO_FLASH eval_release(Program *p)
+{
+  EvalData **link = &p->evalData;
+
+  while (*link != nullptr)
+  {
+    EvalData *block = *link;
+    byteref data = (byteref)(block + 1);
+    bool used = false;
+
+    for (uint i = 0; i < MAX_SLOTS && !used; i++)
+    {
+      byte type = p->slots[i].getType();
+      byteref value = p->slots[i].toString();
+
+      used = (type == vt_string || type == vt_blob) && value >= data && value < data + block->size;
+    }
+
+    if (used)
+    {
+      link = &block->next;
+      continue;
+    }
+
+    *link = block->next;
+    os_free(block);
+  }
+}
+
+// Run until the fragment ends or uses the eval budget. Returns an error, or nullptr
+const char *MOVE_TO_FLASH _runEval(Program *p)
+{
+  uint budget = EVAL_BUDGET;
+  int stack = p->callStackCursor;
+
+  while (!p->delayTime && !p->paused)
+  {
+    Instruction *next = &p->code[p->counter];
+
+    if (next->opcode == op_halt || (next->opcode == op_return && p->callStackCursor == stack))
+      return nullptr;
+
+    if (budget-- == 0)
+      return "eval used its instruction budget";
+
+    vm_next(p);
+  }
+
+  return p->paused ? "eval stopped on an error" : nullptr;
+}
+
+// Run `length` bytes of code, followed by a \0 in _wordSize(length) bytes, inside a program. What the fragment prints
+// goes to `output` instead of the output of the program, up to the room left in its ring,
+// and `outputLength` is set to its length. Returns an error, or nullptr if it ran
+const char *MOVE_TO_FLASH program_eval(Program *p, byteref fragment, uint length, char *output, uint *outputLength)
+{
+  Instruction *code;
+  Instruction instruction;
+  uint count = 0;
+  int cursor;
+  uint i;
+  const char *error = nullptr;
+
+  // the program as it is, put back after the fragment
+  byteref bytes = p->bytes;
+  uint endOfTheProgram = p->endOfTheProgram;
+  Instruction *programCode = p->code;
+  uint instructionCount = p->instructionCount;
+  Instruction *current = p->instruction;
+  byte operandCursor = p->operandCursor;
+  uint counter = p->counter;
+  int callStackCursor = p->callStackCursor;
+  uint delayTime = p->delayTime;
+  bool paused = p->paused;
+  uint droppedBytes = p->droppedBytes;
+  uint printLength = p->printLength;
+  send_callback onSend = p->onSend;
+
+  *outputLength = 0;
+
+  if (!p->verified || p->code == nullptr)
+    return "no program to run in";
+
+  if (p->callStackCursor >= MAX_STACK_CURSOR)
+    return "no room on the call stack";
+
+  for (cursor = 0; cursor < (int)length && cursor != -1; count++)
+  {
+    cursor = _decodeInstruction(p, fragment, cursor, length, &instruction);
+  }
+
+  if (cursor == -1)
+    return "operand past the end of the fragment";
+
+  code = (Instruction *)_allocate(p, (count + 1) * sizeof(Instruction));
+
+  for (i = 0, cursor = 0; i < count; i++)
+  {
+    cursor = _decodeInstruction(p, fragment, cursor, length, &code[i]);
+  }
+
+  code[count].opcode = op_halt;
+  code[count].offset = length;
+
+  p->bytes = fragment;
+  p->endOfTheProgram = length;
+  p->code = code;
+  p->instructionCount = count;
+
+  for (i = 0; i < count && error == nullptr; i++)
+  {
+    error = code[i].opcode == op_iointerrupt ? "interrupt handlers are not kept after an eval"
+                                             : _verifyInstruction(p, &code[i], code[i + 1].offset);
+  }
+
+  // the program reads the value the optimizer put in place of such a slot, not the slot
+  if (error == nullptr && program_writesConstant(p, code, count) != -1)
+    error = "the fragment writes a slot the optimizer made a constant";
+
+  if (error == nullptr)
+  {
+    for (i = 0; i < count; i++)
+    {
+      _resolveInstruction(p, i);
+    }
+
+    // the calls of the fragment go above an entry that is no counter, as the top of the
+    // program's stack can equal the counter of a call in the fragment, which would not be pushed
+    p->callStack[p->callStackCursor++] = -1;
+    p->onSend = &_holdOutput;
+    p->counter = 0;
+    p->delayTime = 0;
+    p->paused = false;
+    error = _runEval(p);
+    _keepEvalData(p, fragment, length + 1);
+    eval_release(p);
+
+    for (i = 0; i < p->printLength - printLength && i < MAX_PRINT_BUFFER; i++)
+    {
+      output[i] = p->printBuffer[(p->printHead + printLength + i) % MAX_PRINT_BUFFER];
+    }
+
+    *outputLength = i;
+  }
+
+  // calls the fragment did not return from are dropped, with the entry under them
+  for (; p->callStackCursor > callStackCursor; p->callStackCursor--)
+  {
+    p->callStack[p->callStackCursor - 1] = 0;
+  }
+
+  p->bytes = bytes;
+  p->endOfTheProgram = endOfTheProgram;
+  p->code = programCode;
+  p->instructionCount = instructionCount;
+  p->instruction = current;
+  p->operandCursor = operandCursor;
+  p->counter = counter;
+  p->delayTime = delayTime;
+  p->paused = paused;
+  p->printLength = printLength;
+  p->droppedBytes = droppedBytes;
+  p->onSend = onSend;
+  os_free(code);
+
+  return error;
+}
+
+#endif
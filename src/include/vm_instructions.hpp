@@ -1,8 +1,19 @@
 void vm_next(Program *p);
+void vm_run(Program *p);
+void program_optimize(Program *p);
+void profiler_enter(Program *p);
+void profiler_leave(Program *p);
+void profiler_clear(Program *p);
+void trace_start(Program *p);
+void trace_stop(Program *p);
+void eval_release(Program *p);
+#ifdef WITH_TRACE
+void trace_write(Program *p, const char *format, va_list args);
+#endif
 void _printf(Program *p, const char *format, ...) __attribute__((format(printf, 2, 3)));
 void _printf(Program *p, const char *format, ...)
 {
-  if (p->onSend == nullptr)
+  if (p->onSend == nullptr && p->report == nullptr)
   {
     return;
   }
@@ -19,65 +30,125 @@ void _debug(Program *p, const char *format, ...)
   {
     va_list args;
     va_start(args, format);
+#ifdef WITH_TRACE
+    trace_write(p, format, args);
+#else
     p->printf(format, args);
+#endif
     va_end(args);
   }
 }
 
-byteref _readByte(Program *p)
+// Heap memory taken for a program, counted in its stats
+void *_allocate(Program *p, int size)
 {
-  byteref reference = &p->bytes[p->counter];
-  p->counter += 1;
+  STATS(p->stats.allocations++; p->stats.allocatedBytes += size);
+  return os_zalloc(size);
+}
+
+void *_reallocate(Program *p, void *memory, int size)
+{
+  STATS(p->stats.allocations++; p->stats.allocatedBytes += size);
+  return os_realloc(memory, size);
+}
+
+// Program bytes can be in RAM or in memory-mapped flash, where only aligned words
+// can be read. The decoder reads every byte through here
+byte _byteAt(byteref bytes, int cursor)
+{
+  return os_readByte(bytes + cursor);
+}
+
+// Size of a RAM copy of `length` bytes that are read through _byteAt: one more byte
+// for a \0, in whole words, so that the word of the last byte is inside the copy
+uint _wordSize(uint length)
+{
+  return (length + 4) & ~3u;
+}
+
+#ifdef WITH_STATS
+// Charge the time since the last dispatch to the instruction that ran before,
+// and count the one about to run
+void _countInstruction(Program *p)
+{
+  Stats *stats = &p->stats;
+  uint now = (uint)os_time();
+  byte opcode = p->instruction->opcode;
+
+  if (stats->lastOpcode)
+    stats->time[stats->lastOpcode] += now - stats->lastTime;
+
+  stats->lastOpcode = opcode < MAX_OPCODES ? opcode : 0;
+  stats->lastTime = now;
+  stats->executions[stats->lastOpcode]++;
+}
+
+// The last instruction of a tick ends when the tick ends
+void _stopCounting(Program *p)
+{
+  Stats *stats = &p->stats;
+
+  if (stats->lastOpcode)
+    stats->time[stats->lastOpcode] += (uint)os_time() - stats->lastTime;
+
+  stats->lastOpcode = 0;
+}
+#endif
+
+#if TRACE_LEVEL >= TRACE_ALL
+#define DEBUG_LOG(p, ...) _debug(p, __VA_ARGS__)
+#else
+#define DEBUG_LOG(p, ...)
+#endif
+
+#if TRACE_LEVEL >= TRACE_ERRORS
+#define DEBUG_ERROR(p, ...) _debug(p, __VA_ARGS__)
+#else
+#define DEBUG_ERROR(p, ...)
+#endif
+
+// for debug output that needs more than one call
+#define DEBUGGING(p) (TRACE_LEVEL >= TRACE_ALL && (p)->debug)
+
+Operand *_readOperand(Program *p)
+{
+  return &p->instruction->operands[p->operandCursor++];
+}
 
-  return reference;
+// Read the id of the slot an instruction writes to
+byte _readSlot(Program *p)
+{
+  return (byte)_readOperand(p)->number;
 }
 
+// Read an operand as a value. Identifiers resolve to the value of their slot
 Value _readValue(Program *p)
 {
-  byte type = *(_readByte(p));
+  Operand *operand = _readOperand(p);
   Value value;
-  byteref ref;
 
-  switch (type)
+  switch (operand->type)
   {
-  case vt_byte:
-  case vt_pin:
   case vt_identifier:
-    value.update(type, (void *)_readByte(p));
-    break;
-
-  case vt_null:
-    value.update(type, 0);
-    _readByte(p);
-    break;
-
-  case vt_integer:
-  case vt_address:
-    ref = &p->bytes[p->counter];
-    p->counter += 4;
-    value.update(type, (void *)ref);
-    break;
+    return p->slots[operand->number];
 
   case vt_string:
-    // extra \0 at the end of string
-    ref = &p->bytes[p->counter];
-    p->counter += os_strlen((const char *)ref) + 1;
-    value.update(type, (void *)ref);
+  case vt_blob:
+    value.update(operand->type, (void *)operand->data);
     break;
 
-  case vt_blob:
-    byteref ref = p->bytes;
-    ref += p->counter;
-    int length = *((int *)ref);
-    ref += 4;
-    Buffer *b = (Buffer *)os_zalloc(sizeof(Buffer));
-    b->load(ref, length);
-    value.update(type, b, true);
+  default:
+    value.update(operand->type, operand->number);
   }
 
   return value;
 }
 
+uint _offsetOf(Program *p, uint position)
+{
+  return p->code[position].offset;
+}
+
 void _printValue(Program *p, Value value)
 {
   byte ch;
@@ -127,41 +198,45 @@ void _printValue(Program *p, Value value)
   }
 }
 
+// Slots keep their numeric type. Any other slot becomes an integer
 void _updateSlotWithInteger(Program *p, byte slotId, uint value)
 {
-  auto type = p->slots[slotId].getType();
-  auto valueRef = os_zalloc(sizeof(uint));
-  *((uintref)valueRef) = value;
+  auto type = p->slots[slotId].isNumber() ? p->slots[slotId].getType() : vt_integer;
 
-  p->slots[slotId].update(type, valueRef, true);
+  p->slots[slotId].update(type, value);
 }
 
-void vm_tick(void *p)
+// One timer tick: run until the program yields or uses its instruction budget,
+// then arm the timer for the delay it asked for
+void _tick(Program *program, void (*run)(Program *))
 {
-  Program *program = (Program *)p;
-
   if (program->paused)
   {
     os_timer_disarm(&program->timer);
-    _debug(program, "\n[!] program is paused\n");
+    DEBUG_ERROR(program, "\n[!] program is paused\n");
     return;
   }
 
-  while (!program->delayTime && !program->paused)
-  {
-    vm_next(program);
-  }
+  profiler_enter(program);
+  run(program);
+  profiler_leave(program);
 
-  if (program->delayTime)
+  if (program->delayTime || program->preempted)
   {
     int delay = program->delayTime;
     program->delayTime = 0;
+    program->preempted = false;
     program->flush();
     os_timer_disarm(&program->timer);
     os_timer_arm(&program->timer, (uint32)delay, 0);
   }
 }
 
+void vm_tick(void *p)
+{
+  _tick((Program *)p, &vm_run);
+}
+
 void _onInterruptTriggered(void *arg, byte pin)
 {
   Program *p = (Program *)arg;
@@ -176,19 +251,12 @@ void _onInterruptTriggered(void *arg, byte pin)
 
 // ========= Instructions =========
 
-void MOVE_TO_FLASH vm_binaryOperation(Program *p, byte operation)
+uint _operate(byte operation, uint valueOfA, uint valueOfB)
 {
-  auto target = _readValue(p);
-  auto a = _readValue(p);
-  auto b = _readValue(p);
-
-  auto valueOfA = a.toInteger();
-  auto valueOfB = b.toInteger();
-  uint newValue;
+  uint newValue = 0;
 
   switch (operation)
   {
-
   case op_gt:
     newValue = valueOfA > valueOfB;
     break;
@@ -233,56 +301,106 @@ void MOVE_TO_FLASH vm_binaryOperation(Program *p, byte operation)
     break;
   }
 
-  _updateSlotWithInteger(p, target.toByte(), newValue);
-  _debug(p, "Binary %d: $%d = %d\n", operation, target.toByte(), newValue);
+  return newValue;
+}
+
+void MOVE_TO_FLASH vm_binaryOperation(Program *p, byte operation)
+{
+  auto target = _readSlot(p);
+  auto a = _readValue(p);
+  auto b = _readValue(p);
+  uint newValue = _operate(operation, a.toInteger(), b.toInteger());
+
+  _updateSlotWithInteger(p, target, newValue);
+  DEBUG_LOG(p, "Binary %d: $%d = %d\n", operation, target, newValue);
 }
 
 void MOVE_TO_FLASH vm_unaryOperation(Program *p, byte operation)
 {
-  auto target = _readValue(p);
-  auto newValue = target.toInteger() + ((operation == op_inc) ? 1 : -1);
+  auto target = _readSlot(p);
+  auto newValue = p->slots[target].toInteger() + ((operation == op_inc) ? 1 : -1);
 
-  _updateSlotWithInteger(p, target.toByte(), newValue);
-  _debug(p, "Unary %d: $%d = %d\n", operation, target.toByte(), newValue);
+  _updateSlotWithInteger(p, target, newValue);
+  DEBUG_LOG(p, "Unary %d: $%d = %d\n", operation, target, newValue);
 }
 
 void MOVE_TO_FLASH vm_notOperation(Program *p)
 {
-  auto target = _readValue(p);
+  auto target = _readSlot(p);
   auto value = !_readValue(p).toBoolean();
 
-  _updateSlotWithInteger(p, target.toByte(), (uint)value);
-  _debug(p, "Not %d: %d\n", target.toByte(), value);
+  _updateSlotWithInteger(p, target, (uint)value);
+  DEBUG_LOG(p, "Not %d: %d\n", target, value);
+}
+
+// Compare two values and jump without touching the call stack.
+// Each opcode maps to the comparison with the same order, from op_gt to op_notequal
+void MOVE_TO_FLASH vm_compareAndJump(Program *p, byte operation)
+{
+  auto a = _readValue(p);
+  auto b = _readValue(p);
+  auto position = _readOperand(p)->number;
+  byte comparison = operation - op_jumpgt + op_gt;
+
+  if (!_operate(comparison, a.toInteger(), b.toInteger()))
+    return;
+
+  DEBUG_LOG(p, "compare jump %d -> %d\n", _offsetOf(p, p->counter), _offsetOf(p, position));
+  p->counter = position;
+}
+
+// $slot++, then jump while $slot < limit
+void MOVE_TO_FLASH vm_incrementAndJump(Program *p)
+{
+  auto target = _readSlot(p);
+  auto limit = _readValue(p).toInteger();
+  auto position = _readOperand(p)->number;
+  uint newValue = p->slots[target].toInteger() + 1;
+
+  _updateSlotWithInteger(p, target, newValue);
+
+  if (newValue >= limit)
+    return;
+
+  DEBUG_LOG(p, "inc jump $%d = %d, %d -> %d\n", target, newValue, _offsetOf(p, p->counter), _offsetOf(p, position));
+  p->counter = position;
+}
+
+void MOVE_TO_FLASH vm_addToSlot(Program *p)
+{
+  auto target = _readSlot(p);
+  uint newValue = p->slots[target].toInteger() + _readValue(p).toInteger();
+
+  _updateSlotWithInteger(p, target, newValue);
+  DEBUG_LOG(p, "Add $%d = %d\n", target, newValue);
 }
 
 void MOVE_TO_FLASH vm_assignOperation(Program *p)
 {
-  auto target = _readValue(p);
+  auto target = _readSlot(p);
   auto value = _readValue(p);
 
-  p->slots[target.toByte()].update(value);
+  p->slots[target].update(value);
 }
 
 void MOVE_TO_FLASH vm_sleep(Program *p)
 {
   auto time = _readValue(p).toInteger();
 
-  _debug(p, "sleep %d\n", time);
+  DEBUG_LOG(p, "sleep %d\n", time);
   os_sleep((uint64)time);
 }
 
 void MOVE_TO_FLASH vm_halt(Program *p)
 {
-  _debug(p, "halt\n");
+  DEBUG_LOG(p, "halt\n");
   p->paused = true;
+  p->flush();
 
-  if (p->onHalt == nullptr)
+  if (p->onHalt != nullptr)
   {
-    return;
+    p->onHalt();
   }
-
-  p->onHalt();
-  p->flush();
 }
 
 void MOVE_TO_FLASH vm_yield(Program *p)
@@ -290,28 +408,41 @@ void MOVE_TO_FLASH vm_yield(Program *p)
   p->delayTime = 1;
 }
 
+// The tick ran out of instructions: give the SDK a turn and resume at the same instruction
+void vm_preempt(Program *p)
+{
+  p->preempted = true;
+  p->preemptions++;
+}
+
 void MOVE_TO_FLASH vm_delay(Program *p)
 {
   p->delayTime = _readValue(p).toInteger();
 
   if (p->delayTime > MAX_DELAY)
   {
-    _debug(p, "delay max\n");
+    DEBUG_ERROR(p, "delay max\n");
     p->delayTime = MAX_DELAY;
   }
 
-  _debug(p, "delay %d\n", p->delayTime);
+  DEBUG_LOG(p, "delay %d\n", p->delayTime);
 }
 
 void MOVE_TO_FLASH vm_ioInterrupt(Program *p)
 {
   auto pin = _readValue(p).toByte();
   auto mode = _readValue(p).toByte();
-  auto position = _readValue(p).toInteger();
+  auto position = _readOperand(p)->number;
   void *handler = (void *)&_onInterruptTriggered;
 
+  if (pin >= NUMBER_OF_PINS)
+  {
+    DEBUG_ERROR(p, "invalid pin %d\n", pin);
+    return;
+  }
+
   p->interruptHandlers[pin] = position;
-  _debug(p, "interrupt pin %d, mode %d, jump to %d\n", pin, mode, position);
+  DEBUG_LOG(p, "interrupt pin %d, mode %d, jump to %d\n", pin, mode, _offsetOf(p, position));
   os_io_interrupt(pin, handler, (void *)p, mode);
 }
 
@@ -322,53 +453,74 @@ void MOVE_TO_FLASH vm_ioInterruptToggle(Program *p)
   if (enabled)
   {
     os_io_enableInterrupts();
-    _debug(p, "interrupts armed\n");
+    DEBUG_LOG(p, "interrupts armed\n");
     return;
   }
 
   os_io_disableInterrupts();
-  _debug(p, "interrupts disarmed\n");
+  DEBUG_LOG(p, "interrupts disarmed\n");
 }
 
 void MOVE_TO_FLASH vm_jumpTo(Program *p)
 {
-  auto position = _readValue(p).toInteger();
+  auto position = _readOperand(p)->number;
 
   if (p->callStackPush() != -1)
   {
-    _debug(p, "jump %d -> %d\n", p->counter, position);
+    DEBUG_LOG(p, "jump %d -> %d\n", _offsetOf(p, p->counter), _offsetOf(p, position));
     p->counter = position;
     return;
   }
 
-  _debug(p, "Max call stack %d\n", position);
+  DEBUG_ERROR(p, "Max call stack %d\n", _offsetOf(p, position));
   p->stackTrace();
 }
 
 void MOVE_TO_FLASH vm_jumpIf(Program *p)
 {
   auto condition = _readValue(p);
-  auto position = _readValue(p).toInteger();
+  auto position = _readOperand(p)->number;
 
   if (!condition.toBoolean())
     return;
 
   if (p->callStackPush() != -1)
   {
-    _debug(p, "if jump %d -> %d\n", p->counter, position);
+    DEBUG_LOG(p, "if jump %d -> %d\n", _offsetOf(p, p->counter), _offsetOf(p, position));
     p->counter = position;
     return;
   }
 
-  _debug(p, "Max call stack %d\n", position);
+  DEBUG_ERROR(p, "Max call stack %d\n", _offsetOf(p, position));
   p->stackTrace();
 }
 
+// Plain jumps, without a return address
+void MOVE_TO_FLASH vm_goto(Program *p)
+{
+  auto position = _readOperand(p)->number;
+
+  DEBUG_LOG(p, "goto %d -> %d\n", _offsetOf(p, p->counter), _offsetOf(p, position));
+  p->counter = position;
+}
+
+void MOVE_TO_FLASH vm_gotoIf(Program *p)
+{
+  auto condition = _readValue(p);
+  auto position = _readOperand(p)->number;
+
+  if (!condition.toBoolean())
+    return;
+
+  DEBUG_LOG(p, "if goto %d -> %d\n", _offsetOf(p, p->counter), _offsetOf(p, position));
+  p->counter = position;
+}
+
 void MOVE_TO_FLASH vm_return(Program *p)
 {
   if (p->callStackPop() != -1)
   {
-    _debug(p, "return to %d\n", p->counter);
+    DEBUG_LOG(p, "return to %d\n", _offsetOf(p, p->counter));
   }
 }
 
@@ -379,12 +531,13 @@ void MOVE_TO_FLASH vm_toggleDebug(Program *p)
   if (value)
   {
     p->debug = true;
+    trace_start(p);
     os_enableSerial();
-    _debug(p, "serial debug on\n");
+    DEBUG_LOG(p, "serial debug on\n");
     return;
   }
 
-  _debug(p, "serial debug off\n");
+  DEBUG_LOG(p, "serial debug off\n");
   p->debug = false;
   os_disableSerial();
 }
@@ -396,58 +549,92 @@ void MOVE_TO_FLASH vm_printStationStatus(Program *p)
 
 void MOVE_TO_FLASH vm_systemInformation(Program *p)
 {
-  _debug(p, "Time now: %d\n", os_time() / 1000);
-  _debug(p, "Free mem: %d bytes\n", os_freeHeapSize());
+  DEBUG_LOG(p, "Time now: %d\n", os_time() / 1000);
+  DEBUG_LOG(p, "Free mem: %d bytes\n", os_freeHeapSize());
+  DEBUG_LOG(p, "Preempted: %d times, every %d instructions\n", p->preemptions, p->instructionBudget);
+  DEBUG_LOG(p, "Output: %d bytes dropped\n", p->droppedBytes);
+#ifdef WITH_OPTIMIZER
+  DEBUG_LOG(p, "Optimized: %d constants folded, %d instructions and %d bytes removed\n",
+            p->optimization.folded, p->optimization.removedInstructions, p->optimization.removedBytes);
+#endif
+}
+
+// Print the counters of WITH_STATS: every opcode that ran, how often and for how long
+void MOVE_TO_FLASH vm_printStats(Program *p)
+{
+#ifdef WITH_STATS
+  Stats *stats = &p->stats;
+
+  _printf(p, "Stats: %d instructions, %d allocations (%d bytes), %d bytes sent, %d dropped\n",
+          (uint)p->instructionsRun, stats->allocations, stats->allocatedBytes, stats->outputBytes, p->droppedBytes);
+#ifdef WITH_OPTIMIZER
+  _printf(p, "Optimized: %d constants folded, %d instructions and %d bytes removed\n",
+          p->optimization.folded, p->optimization.removedInstructions, p->optimization.removedBytes);
+#endif
+
+  for (uint i = 0; i < MAX_OPCODES; i++)
+  {
+    if (stats->executions[i])
+      _printf(p, "  op %x: %d runs, %d us\n", i, stats->executions[i], stats->time[i]);
+  }
+#endif
 }
 
 void MOVE_TO_FLASH vm_dump(Program *p)
 {
   uint i = 0;
-  _debug(p, "\nProgram\n");
+
+  if (!DEBUGGING(p))
+    return;
+
+  DEBUG_LOG(p, "\nProgram\n");
   while (i < p->endOfTheProgram)
   {
-    _debug(p, "%x ", p->bytes[i++]);
+    DEBUG_LOG(p, "%x ", _byteAt(p->bytes, i++));
   }
 
-  _debug(p, "\nSlots\n");
+  DEBUG_LOG(p, "\nSlots\n");
   for (i = 0; i < MAX_SLOTS; i++)
   {
     if (p->slots[i].getType() != vt_null)
     {
-      _debug(p, "%d: '", i);
+      DEBUG_LOG(p, "%d: '", i);
       _printValue(p, p->slots[i]);
-      _debug(p, "'\n");
+      DEBUG_LOG(p, "'\n");
     }
   }
 
-  _debug(p, "\nInterrupts\n");
+  DEBUG_LOG(p, "\nInterrupts\n");
   for (i = 0; i < NUMBER_OF_PINS; i++)
   {
     if (p->interruptHandlers[i])
     {
-      _debug(p, "%d: %d\n", i, p->interruptHandlers[i]);
+      DEBUG_LOG(p, "%d: %d\n", i, _offsetOf(p, p->interruptHandlers[i]));
     }
   }
 }
 
 void MOVE_TO_FLASH vm_declareReference(Program *p)
 {
-  auto slotId = _readValue(p).toByte();
+  auto slotId = _readSlot(p);
   auto value = _readValue(p);
 
   p->slots[slotId].update(value);
 
-  _debug(p, "declare %d, %d = ", slotId, p->slots[slotId].getType());
-  _printValue(p, p->slots[slotId]);
-  _debug(p, "\n");
+  if (DEBUGGING(p))
+  {
+    DEBUG_LOG(p, "declare %d, %d = ", slotId, p->slots[slotId].getType());
+    _printValue(p, p->slots[slotId]);
+    DEBUG_LOG(p, "\n");
+  }
 }
 
 void MOVE_TO_FLASH vm_readFromMemory(Program *p)
 {
-  auto slotId = _readValue(p).toByte();
+  auto slotId = _readSlot(p);
   auto address = _readValue(p).toInteger();
 
-  _debug(p, "memget [%d], %d\n", slotId, address);
+  DEBUG_LOG(p, "memget [%d], %d\n", slotId, address);
 
   // if (1)
   // {
@@ -461,7 +648,7 @@ void MOVE_TO_FLASH vm_readFromMemory(Program *p)
   //   return (val_aligned >> shift) & 0xff;
   // }
 
-  p->slots[slotId].update(vt_address, (void *)address);
+  p->slots[slotId].update(vt_address, address);
 }
 
 void MOVE_TO_FLASH vm_writeToMemory(Program *p)
@@ -469,7 +656,7 @@ void MOVE_TO_FLASH vm_writeToMemory(Program *p)
   auto address = (void *)_readValue(p).toInteger();
   auto value = _readValue(p);
 
-  _debug(p, "memset %p\n", address);
+  DEBUG_LOG(p, "memset %p\n", address);
 
   switch (value.getType())
   {
@@ -496,7 +683,7 @@ void MOVE_TO_FLASH vm_ioMode(Program *p)
   auto pin = _readValue(p).toByte();
   auto value = _readValue(p).toByte();
 
-  _debug(p, "io mode %d %d\n", pin, value);
+  DEBUG_LOG(p, "io mode %d %d\n", pin, value);
 
   if (value >= 0 && value <= 3)
   {
@@ -509,7 +696,7 @@ void MOVE_TO_FLASH vm_ioType(Program *p)
   auto pin = _readValue(p).toByte();
   auto value = _readValue(p).toByte();
 
-  _debug(p, "io type %d %d\n", pin, value);
+  DEBUG_LOG(p, "io type %d %d\n", pin, value);
   if (value >= 0 && value <= 4)
   {
     os_io_type(pin, value);
@@ -521,28 +708,28 @@ void MOVE_TO_FLASH vm_ioWrite(Program *p)
   auto pin = _readValue(p).toByte();
   auto value = _readValue(p).toBoolean();
 
-  _debug(p, "io write %d %d\n", pin, value);
+  DEBUG_LOG(p, "io write %d %d\n", pin, value);
   os_io_write(pin, value);
 }
 
 void MOVE_TO_FLASH vm_ioRead(Program *p)
 {
-  auto target = _readValue(p);
+  auto target = _readSlot(p);
   auto value = _readValue(p).fromPin();
 
-  _updateSlotWithInteger(p, target.toByte(), (uint)value);
-  _debug(p, "io read %d, %d\n", target.toByte(), (uint)value);
+  _updateSlotWithInteger(p, target, (uint)value);
+  DEBUG_LOG(p, "io read %d, %d\n", target, (uint)value);
 }
 
 void MOVE_TO_FLASH vm_ioAllOut(Program *p)
 {
-  _debug(p, "io all out\n");
+  DEBUG_LOG(p, "io all out\n");
   os_io_allOutput();
 }
 
 void MOVE_TO_FLASH vm_startAccessPoint(Program *p)
 {
-  _debug(p, "startAccessPoint\n");
+  DEBUG_LOG(p, "startAccessPoint\n");
   os_wifi_ap();
 }
 
@@ -552,7 +739,7 @@ void MOVE_TO_FLASH vm_wifiConnect(Program *p)
   auto password = _readValue(p);
   bool hasPassword = password.getType() == vt_string;
 
-  _debug(p, "connect to %s / %s\n", ssid, password.toString());
+  DEBUG_LOG(p, "connect to %s / %s\n", ssid, password.toString());
 
   if (hasPassword)
   {
@@ -579,169 +766,116 @@ void MOVE_TO_FLASH vm_i2csetup(Program *p)
   auto clockPin = _readValue(p).toByte();
 
   os_i2c_setup(dataPin, clockPin);
-  _debug(p, "i2c setup SDA %d, SCK %d\n", dataPin, clockPin);
+  DEBUG_LOG(p, "i2c setup SDA %d, SCK %d\n", dataPin, clockPin);
 }
 
 void MOVE_TO_FLASH vm_i2cstart(Program *p)
 {
-  _debug(p, "i2c start\n");
+  DEBUG_LOG(p, "i2c start\n");
   os_i2c_start();
 }
 
 void MOVE_TO_FLASH vm_i2cstop(Program *p)
 {
-  _debug(p, "i2c stop\n");
+  DEBUG_LOG(p, "i2c stop\n");
   os_i2c_stop();
 }
 
 void MOVE_TO_FLASH vm_i2cwrite(Program *p)
 {
   auto byte = _readValue(p).toByte();
-  _debug(p, "i2c write %d\n", byte);
+  DEBUG_LOG(p, "i2c write %d\n", byte);
   os_i2c_writeByteAndAck(byte);
 }
 
 void MOVE_TO_FLASH vm_i2cfind(Program *p)
 {
-  auto slotId = _readValue(p).toByte();
+  auto slotId = _readSlot(p);
   byte deviceId = os_i2c_findDevice();
-  byte *value = (byte *)os_zalloc(sizeof(byte));
-  *value = deviceId;
-  p->slots[slotId].update(vt_byte, value, true);
-  _debug(p, "i2c find %d\n", slotId);
+
+  p->slots[slotId].update(vt_byte, (uint32)deviceId);
+  DEBUG_LOG(p, "i2c find %d\n", slotId);
 }
 
-void MOVE_TO_FLASH vm_i2cread(Program *p)
+void MOVE_TO_FLASH vm_invalidOperation(Program *p)
 {
-  auto target = _readValue(p);
-  byte value = os_i2c_readByte();
-  void *v = os_zalloc(sizeof(byte));
-  *(byte *)v = value;
-  p->slots[target.toByte()].update(vt_byte, v, true);
-  _debug(p, "i2cread %d\n", value);
+  os_printf("[!] Invalid operation: %d\n", p->instruction->opcode);
+  p->stackTrace();
+  vm_halt(p);
 }
 
-void MOVE_TO_FLASH program_load(Program *program, byteref _bytes, int length)
+void MOVE_TO_FLASH vm_i2cread(Program *p)
 {
-  if (program->bytes != nullptr && program->endOfTheProgram < length)
-  {
-    program->bytes = (byteref)os_realloc(program->bytes, length);
-  }
-
-  if (program->bytes == nullptr)
-  {
-    program->bytes = (byteref)os_zalloc(length);
-  }
-
-  os_memcpy(program->bytes, _bytes, length);
-  program->endOfTheProgram = length;
-  program->reset();
+  auto target = _readSlot(p);
+  byte value = os_i2c_readByte();
 
-  os_timer_disarm(&program->timer);
-  os_timer_setfn(&program->timer, &vm_tick, program);
-  os_timer_arm(&program->timer, 1, 0);
+  p->slots[target].update(vt_byte, (uint32)value);
+  DEBUG_LOG(p, "i2cread %d\n", value);
 }
 
-void vm_next(Program *p)
+// Operands of each opcode, one character per operand:
+// I = slot, B = byte, N = integer, V = any value, S = string,
+// T = jump target, L = length of a function body
+const char *MOVE_TO_FLASH _signatureOf(byte opcode)
 {
-  byte next = *(_readByte(p));
-
-  switch (next)
+  switch (opcode)
   {
   case op_noop:
-    break;
-
   case op_halt:
-    vm_halt(p);
-    break;
-
-  case op_define:
-    p->counter += _readValue(p).toInteger();
-    break;
-
   case op_restart:
-    os_restart();
-    break;
-
-  case op_debug:
-    vm_toggleDebug(p);
-    break;
-
   case op_systeminfo:
-    vm_systemInformation(p);
-    break;
-
-  case op_sleep:
-    vm_sleep(p);
-    break;
-
-  case op_print:
-    _printValue(p, _readValue(p));
-    break;
-
   case op_dump:
-    vm_dump(p);
-    break;
-
-  case op_declare:
-    vm_declareReference(p);
-    break;
-
-  case op_memget:
-    vm_readFromMemory(p);
-    break;
-
-  case op_memset:
-    vm_writeToMemory(p);
-    break;
-
-  case op_iowrite:
-    vm_ioWrite(p);
-    break;
-
-  case op_ioread:
-    vm_ioRead(p);
-    break;
-
-  case op_iomode:
-    vm_ioMode(p);
-    break;
-
-  case op_iotype:
-    vm_ioType(p);
-    break;
-
+  case op_yield:
+  case op_return:
+  case op_stats:
   case op_ioallout:
-    vm_ioAllOut(p);
-    break;
-
-  case op_iointerrupt:
-    vm_ioInterrupt(p);
-    break;
+  case op_wifistatus:
+  case op_wifiap:
+  case op_wifidisconnect:
+  case op_wifilist:
+  case op_i2cstart:
+  case op_i2cstop:
+    return "";
 
+  case op_debug:
+  case op_print:
   case op_iointerruptToggle:
-    vm_ioInterruptToggle(p);
-    break;
+    return "V";
 
   case op_delay:
-    vm_delay(p);
-    break;
+  case op_sleep:
+    return "N";
 
-  case op_yield:
-    vm_yield(p);
-    break;
+  case op_i2cwrite:
+    return "B";
+
+  case op_inc:
+  case op_dec:
+  case op_i2cread:
+  case op_i2cfind:
+    return "I";
 
   case op_jumpto:
-    vm_jumpTo(p);
-    break;
+  case op_goto:
+    return "T";
 
   case op_jumpif:
-    vm_jumpIf(p);
-    break;
+  case op_gotoif:
+    return "VT";
 
-  case op_return:
-    vm_return(p);
-    break;
+  case op_jumpgt:
+  case op_jumpgte:
+  case op_jumplt:
+  case op_jumplte:
+  case op_jumpequal:
+  case op_jumpnotequal:
+    return "VVT";
+
+  case op_incjumplt:
+    return "IVT";
+
+  case op_define:
+    return "L";
 
   case op_gt:
   case op_gte:
@@ -757,29 +891,1037 @@ void vm_next(Program *p)
   case op_mul:
   case op_div:
   case op_mod:
-    vm_binaryOperation(p, next);
-    break;
-
-  case op_inc:
-  case op_dec:
-    vm_unaryOperation(p, next);
-    break;
+    return "IVV";
 
   case op_not:
-    vm_notOperation(p);
-    break;
-
   case op_assign:
-    vm_assignOperation(p);
-    break;
+  case op_declare:
+  case op_addto:
+    return "IV";
 
-  case op_wifistatus:
-    vm_printStationStatus(p);
-    break;
+  case op_iowrite:
+    return "BV";
 
-  case op_wifiap:
-    vm_startAccessPoint(p);
-    break;
+  case op_memget:
+    return "IN";
+
+  case op_memset:
+    return "NV";
+
+  case op_ioread:
+    return "IB";
+
+  case op_iomode:
+  case op_iotype:
+  case op_i2csetup:
+    return "BB";
+
+  case op_iointerrupt:
+    return "BBT";
+
+  case op_wificonnect:
+    return "SV";
+  }
+
+  return nullptr;
+}
+
+uint _decodeInteger(byteref ref)
+{
+  return _byteAt(ref, 3) << 24 |
+         _byteAt(ref, 2) << 16 |
+         _byteAt(ref, 1) << 8 |
+         _byteAt(ref, 0);
+}
+
+// Length of a string of the program, without its \0
+uint _stringLength(byteref string)
+{
+  uint length = 0;
+
+  while (_byteAt(string, length))
+  {
+    length++;
+  }
+
+  return length;
+}
+
+// Unsigned LEB128 used by v2 programs: 7 bits per byte, lowest bits first,
+// with the high bit set on every byte but the last one
+int _decodeVarint(byteref bytes, int cursor, int length, uint *value)
+{
+  uint shift = 0;
+  *value = 0;
+
+  while (cursor < length && shift < 35)
+  {
+    byte b = _byteAt(bytes, cursor++);
+    *value |= (uint)(b & 0x7f) << shift;
+
+    if (!(b & 0x80))
+      return cursor;
+
+    shift += 7;
+  }
+
+  return -1;
+}
+
+// Decode the operand at `cursor`, returning the position after it
+// or -1 if the operand goes past the end of the program
+int MOVE_TO_FLASH _decodeOperand(Program *p, byteref bytes, int cursor, int length, Operand *operand)
+{
+  bool packed = p->version == PACKED_PROGRAM_VERSION;
+  byte type = _byteAt(bytes, cursor++);
+  uint size;
+  operand->type = type;
+  operand->number = 0;
+
+  switch (type)
+  {
+  case vt_byte:
+  case vt_pin:
+  case vt_identifier:
+    if (cursor + 1 > length)
+      return -1;
+
+    operand->number = _byteAt(bytes, cursor);
+    return cursor + 1;
+
+  case vt_null:
+    if (packed)
+      return cursor;
+
+    if (cursor + 1 > length)
+      return -1;
+
+    return cursor + 1;
+
+  case vt_integer:
+  case vt_signedInteger:
+  case vt_address:
+    if (packed)
+      return _decodeVarint(bytes, cursor, length, &operand->number);
+
+    if (cursor + 4 > length)
+      return -1;
+
+    operand->number = _decodeInteger(bytes + cursor);
+    return cursor + 4;
+
+  case vt_string:
+    operand->data = bytes + cursor;
+
+    // extra \0 at the end of string
+    while (cursor < length && _byteAt(bytes, cursor))
+    {
+      cursor++;
+    }
+
+    return cursor < length ? cursor + 1 : length;
+
+  case vt_blob:
+    operand->data = bytes + cursor;
+
+    if (packed)
+    {
+      cursor = _decodeVarint(bytes, cursor, length, &size);
+      return cursor != -1 && size <= (uint)(length - cursor) ? cursor + size : -1;
+    }
+
+    if (cursor + 4 > length)
+      return -1;
+
+    cursor += 4 + _decodeInteger(bytes + cursor);
+    return cursor <= length ? cursor : -1;
+
+  case vt_constant:
+    if (!packed)
+      break;
+
+    cursor = _decodeVarint(bytes, cursor, length, &size);
+
+    if (cursor == -1 || size >= p->poolSize)
+      return -1;
+
+    *operand = p->pool[size];
+    return cursor;
+  }
+
+  // unknown types are rejected by program_verify
+  return cursor;
+}
+
+// Decode the instruction at `cursor`, returning the position of the next one.
+// Decoding stops at the first invalid opcode, which is kept so vm_next can report it
+int MOVE_TO_FLASH _decodeInstruction(Program *p, byteref bytes, int cursor, int length, Instruction *instruction)
+{
+  byte opcode = _byteAt(bytes, cursor);
+  const char *signature = _signatureOf(opcode);
+
+  os_memset(instruction, 0, sizeof(Instruction));
+  instruction->opcode = opcode;
+  instruction->offset = cursor;
+  cursor++;
+
+  if (signature == nullptr)
+  {
+    return length;
+  }
+
+  for (int i = 0; signature[i]; i++)
+  {
+    if (cursor >= length)
+      return -1;
+
+    cursor = _decodeOperand(p, bytes, cursor, length, &instruction->operands[i]);
+
+    if (cursor == -1)
+      return -1;
+  }
+
+  return cursor;
+}
+
+uint MOVE_TO_FLASH _decodeProgram(Program *p, Instruction *code)
+{
+  int length = p->endOfTheProgram;
+  int cursor = 0;
+  uint count = 0;
+  Instruction instruction;
+
+  while (cursor < length)
+  {
+    cursor = _decodeInstruction(p, p->bytes, cursor, length, &instruction);
+
+    if (cursor == -1)
+    {
+      break;
+    }
+
+    if (code != nullptr)
+    {
+      code[count] = instruction;
+    }
+
+    count++;
+  }
+
+  return count;
+}
+
+// Find the instruction that starts at a byte offset.
+// Offsets that do not start an instruction resolve to the end of the program
+uint MOVE_TO_FLASH _instructionAt(Program *p, uint offset)
+{
+  uint low = 0;
+  uint high = p->instructionCount;
+
+  while (low < high)
+  {
+    uint middle = (low + high) / 2;
+
+    if (p->code[middle].offset < offset)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  if (low < p->instructionCount && p->code[low].offset == offset)
+  {
+    return low;
+  }
+
+  return p->instructionCount;
+}
+
+// Turn the byte offsets of jump targets and function ends of a record into records
+void MOVE_TO_FLASH _resolveInstruction(Program *p, uint i)
+{
+  Instruction *instruction = &p->code[i];
+  const char *signature = _signatureOf(instruction->opcode);
+
+  for (int j = 0; signature != nullptr && signature[j]; j++)
+  {
+    Operand *operand = &instruction->operands[j];
+
+    if (signature[j] == 'L')
+    {
+      operand->number = _instructionAt(p, p->code[i + 1].offset + operand->number);
+      continue;
+    }
+
+    if (signature[j] != 'T')
+    {
+      continue;
+    }
+
+    if (operand->type == vt_integer || operand->type == vt_address)
+    {
+      operand->number = _instructionAt(p, operand->number);
+      continue;
+    }
+
+    operand->number = p->instructionCount;
+  }
+}
+
+void MOVE_TO_FLASH _resolveTargets(Program *p)
+{
+  uint i = 0;
+
+  for (; i < p->instructionCount; i++)
+  {
+    _resolveInstruction(p, i);
+  }
+
+  for (i = 0; i < p->functionCount; i++)
+  {
+    p->functions[i] = _instructionAt(p, p->functions[i]);
+  }
+}
+
+Operand *_targetOf(Instruction *instruction)
+{
+  const char *signature = _signatureOf(instruction->opcode);
+
+  for (int j = 0; signature && signature[j]; j++)
+  {
+    if (signature[j] == 'T')
+      return &instruction->operands[j];
+  }
+
+  return nullptr;
+}
+
+bool _isFunction(Program *p, uint position)
+{
+  for (uint i = 0; i < p->functionCount; i++)
+  {
+    if (p->functions[i] == position)
+      return true;
+  }
+
+  return false;
+}
+
+// Add the records that calls and interrupt handlers go to, before tail calls become
+// gotos, to the functions of the program. The optimizer keeps them where they are
+void MOVE_TO_FLASH _collectFunctions(Program *p)
+{
+  uint *functions = (uint *)_allocate(p, (p->functionCount + p->instructionCount + 1) * sizeof(uint));
+  uint i;
+
+  if (p->functions != nullptr)
+  {
+    os_memcpy(functions, p->functions, p->functionCount * sizeof(uint));
+    os_free(p->functions);
+  }
+
+  p->functions = functions;
+
+  for (i = 0; i < p->instructionCount; i++)
+  {
+    Instruction *instruction = &p->code[i];
+    byte opcode = instruction->opcode;
+    uint target;
+
+    if (opcode != op_jumpto && opcode != op_jumpif && opcode != op_iointerrupt)
+      continue;
+
+    target = _targetOf(instruction)->number;
+
+    if (!_isFunction(p, target))
+      p->functions[p->functionCount++] = target;
+  }
+}
+
+// A call followed by a return becomes a plain jump: the function called
+// returns straight to our caller, so the call stack does not grow
+void MOVE_TO_FLASH _eliminateTailCalls(Program *p)
+{
+  uint i = 0;
+
+  for (; i + 1 < p->instructionCount; i++)
+  {
+    if (p->code[i + 1].opcode != op_return)
+      continue;
+
+    if (p->code[i].opcode == op_jumpto)
+      p->code[i].opcode = op_goto;
+
+    if (p->code[i].opcode == op_jumpif)
+      p->code[i].opcode = op_gotoif;
+  }
+}
+
+bool _isTarget(Program *p, uint offset)
+{
+  return offset == p->endOfTheProgram || _instructionAt(p, offset) != p->instructionCount;
+}
+
+// Check one operand against a character of the opcode signature
+const char *MOVE_TO_FLASH _verifyOperand(Program *p, char kind, Operand *operand, uint next)
+{
+  byte type = operand->type;
+  bool isNumber = type == vt_byte || type == vt_pin || type == vt_identifier ||
+                  type == vt_integer || type == vt_signedInteger || type == vt_address;
+
+  switch (kind)
+  {
+  case 'I':
+    if (type != vt_identifier && type != vt_byte)
+      return "slot expected";
+
+    if (operand->number >= MAX_SLOTS)
+      return "slot out of range";
+
+    return nullptr;
+
+  case 'B':
+    return type == vt_byte || type == vt_pin || type == vt_identifier ? nullptr : "byte expected";
+
+  case 'N':
+    return isNumber ? nullptr : "integer expected";
+
+  case 'S':
+    if (type != vt_string)
+      return "string expected";
+
+    break;
+
+  case 'T':
+    if (type != vt_integer && type != vt_address)
+      return "jump target expected";
+
+    return _isTarget(p, operand->number) ? nullptr : "jump target is not an instruction";
+
+  case 'L':
+    if (type != vt_integer)
+      return "function length expected";
+
+    return _isTarget(p, next + operand->number) ? nullptr : "function ends outside of the program";
+  }
+
+  if (type > vt_blob)
+    return "unknown value type";
+
+  if (type == vt_string && operand->data + _stringLength(operand->data) >= p->bytes + p->endOfTheProgram)
+    return "string without end";
+
+  return nullptr;
+}
+
+const char *MOVE_TO_FLASH _verifyInstruction(Program *p, Instruction *instruction, uint next)
+{
+  const char *signature = _signatureOf(instruction->opcode);
+  const char *error;
+
+  if (signature == nullptr)
+    return "invalid operation";
+
+  for (int i = 0; signature[i]; i++)
+  {
+    error = _verifyOperand(p, signature[i], &instruction->operands[i], next);
+
+    if (error != nullptr)
+      return error;
+  }
+
+  if (instruction->opcode == op_iointerrupt && instruction->operands[0].type != vt_identifier &&
+      instruction->operands[0].number >= NUMBER_OF_PINS)
+    return "pin out of range";
+
+  return nullptr;
+}
+
+// Walk the whole program once before it runs, checking operand types,
+// jump targets and interrupt handlers against each opcode signature.
+// Returns the offset of the first invalid instruction, or -1 if the program is valid
+int MOVE_TO_FLASH program_verify(Program *p)
+{
+  int length = p->endOfTheProgram;
+  int cursor = 0;
+  int next;
+  const char *error;
+  Instruction instruction;
+
+  while (cursor < length)
+  {
+    next = _decodeInstruction(p, p->bytes, cursor, length, &instruction);
+    error = next == -1 ? "operand past the end of the program or unknown constant" : _verifyInstruction(p, &instruction, next);
+
+    if (error != nullptr)
+    {
+      os_printf("[!] Invalid program at %d: %s\n", cursor, error);
+      return cursor;
+    }
+
+    cursor = next;
+  }
+
+  for (uint i = 0; i < p->functionCount; i++)
+  {
+    if (_instructionAt(p, p->functions[i]) == p->instructionCount)
+    {
+      os_printf("[!] Invalid program at %d: function is not an instruction\n", p->functions[i]);
+      return p->functions[i];
+    }
+  }
+
+  return -1;
+}
+
+// v2 programs start with 0x00, which is never a valid opcode in v1
+bool _isPackedProgram(byteref bytes, int length)
+{
+  return length >= 4 && _byteAt(bytes, 0) == 0 && _byteAt(bytes, 1) == 'E' && _byteAt(bytes, 2) == 'S' &&
+         _byteAt(bytes, 3) == PACKED_PROGRAM_VERSION;
+}
+
+// Move `cursor` past a varint of the header, keeping it in place if the varint is invalid
+bool _readVarint(byteref bytes, int *cursor, int length, uint *value)
+{
+  int next = _decodeVarint(bytes, *cursor, length, value);
+
+  if (next == -1)
+    return false;
+
+  *cursor = next;
+  return true;
+}
+
+// Read the constant pool and the function table of a v2 program,
+// and find its code section. Returns an error, or nullptr if the header is valid
+const char *MOVE_TO_FLASH _decodeHeader(Program *p, int *cursor)
+{
+  byteref bytes = p->image;
+  int length = p->imageLength;
+  uint count;
+  uint i;
+
+  *cursor = 4;
+
+  if (!_readVarint(bytes, cursor, length, &count) || count > (uint)length)
+    return "invalid constant pool";
+
+  p->pool = (Operand *)_allocate(p, (count + 1) * sizeof(Operand));
+
+  for (i = 0; i < count; i++)
+  {
+    Operand *constant = &p->pool[i];
+    int next = *cursor < length ? _decodeOperand(p, bytes, *cursor, length, constant) : -1;
+
+    if (next == -1 || constant->type > vt_blob)
+      return "invalid constant";
+
+    if (constant->type == vt_string && _byteAt(bytes, next - 1) != 0)
+      return "string without end";
+
+    *cursor = next;
+  }
+
+  p->poolSize = count;
+
+  if (!_readVarint(bytes, cursor, length, &count) || count > (uint)length)
+    return "invalid function table";
+
+  p->functions = (uint *)_allocate(p, (count + 1) * sizeof(uint));
+
+  for (i = 0; i < count; i++)
+  {
+    if (!_readVarint(bytes, cursor, length, &p->functions[i]))
+      return "invalid function table";
+  }
+
+  p->functionCount = count;
+
+  if (!_readVarint(bytes, cursor, length, &count) || count != (uint)(length - *cursor))
+    return "code length does not match the program";
+
+  p->bytes = bytes + *cursor;
+  p->endOfTheProgram = count;
+  return nullptr;
+}
+
+bool _hasData(Operand *operand)
+{
+  return operand->type == vt_string || operand->type == vt_blob;
+}
+
+// Bytes of the string or blob of an operand, with the \0 of a string or the length of a blob
+uint _dataSize(Program *p, Operand *operand)
+{
+  uint size;
+  int start;
+
+  if (operand->type == vt_string)
+    return _stringLength(operand->data) + 1;
+
+  if (p->version != PACKED_PROGRAM_VERSION)
+    return 4 + _decodeInteger(operand->data);
+
+  start = _decodeVarint(operand->data, 0, p->imageLength, &size);
+  return start + size;
+}
+
+byteref _copyOperandData(Program *p, Operand *operand, byteref copy)
+{
+  uint size = _dataSize(p, operand);
+
+  for (uint i = 0; i < size; i++)
+  {
+    copy[i] = _byteAt(operand->data, i);
+  }
+
+  operand->data = copy;
+  return copy + size;
+}
+
+int _poolIndexOf(Program *p, byteref data)
+{
+  for (uint i = 0; i < p->poolSize; i++)
+  {
+    if (_hasData(&p->pool[i]) && p->pool[i].data == data)
+      return i;
+  }
+
+  return -1;
+}
+
+// Copy the strings and blobs of a program in flash to `data`, and point its operands
+// there, so nothing reads the flash while it runs. Operands of one constant share a copy
+void MOVE_TO_FLASH _copyData(Program *p)
+{
+  uint size = 0;
+  uint i;
+  int j;
+  byteref copy;
+  byteref *constants = (byteref *)_allocate(p, (p->poolSize + 1) * sizeof(byteref));
+
+  for (i = 0; i < p->poolSize; i++)
+  {
+    if (_hasData(&p->pool[i]))
+      size += _dataSize(p, &p->pool[i]);
+  }
+
+  for (i = 0; i < p->instructionCount * MAX_OPERANDS; i++)
+  {
+    Operand *operand = &p->code[i / MAX_OPERANDS].operands[i % MAX_OPERANDS];
+
+    if (_hasData(operand) && _poolIndexOf(p, operand->data) == -1)
+      size += _dataSize(p, operand);
+  }
+
+  p->data = (byteref)_allocate(p, _wordSize(size));
+  copy = p->data;
+
+  // room for the constants first, they are copied last to find their operands until then
+  for (i = 0; i < p->poolSize; i++)
+  {
+    if (!_hasData(&p->pool[i]))
+      continue;
+
+    constants[i] = copy;
+    copy += _dataSize(p, &p->pool[i]);
+  }
+
+  for (i = 0; i < p->instructionCount * MAX_OPERANDS; i++)
+  {
+    Operand *operand = &p->code[i / MAX_OPERANDS].operands[i % MAX_OPERANDS];
+
+    if (!_hasData(operand))
+      continue;
+
+    j = _poolIndexOf(p, operand->data);
+
+    if (j == -1)
+      copy = _copyOperandData(p, operand, copy);
+    else
+      operand->data = constants[j];
+  }
+
+  for (i = 0; i < p->poolSize; i++)
+  {
+    if (_hasData(&p->pool[i]))
+      _copyOperandData(p, &p->pool[i], constants[i]);
+  }
+
+  os_free(constants);
+}
+
+void MOVE_TO_FLASH program_decode(Program *program, byteref _bytes, int length)
+{
+  const char *error = nullptr;
+  int cursor = 0;
+
+  STATS(os_memset(&program->stats, 0, sizeof(Stats)));
+
+  // a program for RAM does not reuse an image in flash
+  if (program->imageInFlash && program->image != _bytes)
+  {
+    program->image = nullptr;
+    program->imageInFlash = false;
+  }
+
+  if (!program->imageInFlash && program->image != nullptr && program->imageLength < (uint)length)
+  {
+    program->image = (byteref)_reallocate(program, program->image, _wordSize(length));
+  }
+
+  if (program->image == nullptr)
+  {
+    program->image = (byteref)_allocate(program, _wordSize(length));
+  }
+
+  if (program->image != _bytes)
+  {
+    os_memcpy(program->image, _bytes, length);
+  }
+
+  // a trailing \0 keeps unterminated strings inside the program
+  if (!program->imageInFlash)
+  {
+    program->image[length] = 0;
+  }
+
+  program->imageLength = length;
+  program->bytes = program->image;
+  program->endOfTheProgram = length;
+  program->version = 1;
+  program->reset();
+  profiler_clear(program);
+#ifdef WITH_EVAL
+  eval_release(program);
+#endif
+
+  if (program->code != nullptr)
+  {
+    os_free(program->code);
+  }
+
+  os_free(program->data);
+  program->data = nullptr;
+
+  if (program->pool != nullptr)
+  {
+    os_free(program->pool);
+    program->pool = nullptr;
+  }
+
+  if (program->functions != nullptr)
+  {
+    os_free(program->functions);
+    program->functions = nullptr;
+  }
+
+  program->poolSize = 0;
+  program->functionCount = 0;
+
+  if (_isPackedProgram(_bytes, length))
+  {
+    program->version = PACKED_PROGRAM_VERSION;
+    error = _decodeHeader(program, &cursor);
+  }
+
+  if (error != nullptr)
+  {
+    os_printf("[!] Invalid program at %d: %s\n", cursor, error);
+    program->endOfTheProgram = 0;
+    program->functionCount = 0;
+  }
+
+  // an extra halt at the end marks the end of the program
+  program->instructionCount = _decodeProgram(program, nullptr);
+  program->code = (Instruction *)_allocate(program, (program->instructionCount + 1) * sizeof(Instruction));
+  _decodeProgram(program, program->code);
+  program->code[program->instructionCount].opcode = op_halt;
+  program->code[program->instructionCount].offset = program->endOfTheProgram;
+  program->verified = error == nullptr && program_verify(program) == -1;
+  _resolveTargets(program);
+#ifdef WITH_PATCH
+  // patches replace functions by the offset of their first record
+  _collectFunctions(program);
+#endif
+  _eliminateTailCalls(program);
+
+  if (program->verified && program->imageInFlash)
+  {
+    _copyData(program);
+  }
+
+#ifdef WITH_OPTIMIZER
+  os_memset(&program->optimization, 0, sizeof(Optimization));
+#endif
+
+  if (program->verified)
+  {
+    program_optimize(program);
+  }
+}
+
+bool MOVE_TO_FLASH program_load(Program *program, byteref _bytes, int length)
+{
+  program_decode(program, _bytes, length);
+
+  if (!program->verified)
+  {
+    program->paused = true;
+    return false;
+  }
+
+  os_timer_disarm(&program->timer);
+  os_timer_setfn(&program->timer, &vm_tick, program);
+  os_timer_arm(&program->timer, 1, 0);
+  return true;
+}
+
+// Load a program from _wordSize(length) bytes of os_zalloc, which become its image instead of a copy
+bool MOVE_TO_FLASH program_loadImage(Program *program, byteref image, int length)
+{
+  if (program->image != image)
+  {
+    if (!program->imageInFlash)
+      os_free(program->image);
+
+    program->image = image;
+    program->imageLength = length;
+    program->imageInFlash = false;
+  }
+
+  return program_load(program, image, length);
+}
+
+// Load a program from memory-mapped flash, without a copy of it in RAM: only the records
+// of its instructions and its strings and blobs are kept. Bytes of the image are read
+// in aligned words, and only while it loads and in `dump`
+bool MOVE_TO_FLASH program_loadInPlace(Program *program, byteref image, int length)
+{
+  if (program->image != image)
+  {
+    if (!program->imageInFlash)
+      os_free(program->image);
+
+    program->image = image;
+    program->imageLength = length;
+    program->imageInFlash = true;
+  }
+
+  return program_load(program, image, length);
+}
+
+// Stop a program and release the memory of its code, leaving the Program empty
+void MOVE_TO_FLASH program_unload(Program *program)
+{
+  os_timer_disarm(&program->timer);
+  trace_stop(program);
+  program->reset();
+  program->paused = true;
+#ifdef WITH_EVAL
+  eval_release(program);
+#endif
+
+  if (!program->imageInFlash)
+    os_free(program->image);
+
+  os_free(program->data);
+  os_free(program->code);
+  os_free(program->pool);
+  os_free(program->functions);
+#ifdef WITH_PROFILER
+  os_free(program->profile);
+  program->profile = nullptr;
+#endif
+  program->image = nullptr;
+  program->imageInFlash = false;
+  program->data = nullptr;
+  program->bytes = nullptr;
+  program->code = nullptr;
+  program->pool = nullptr;
+  program->functions = nullptr;
+  program->imageLength = 0;
+  program->endOfTheProgram = 0;
+  program->instructionCount = 0;
+  program->poolSize = 0;
+  program->functionCount = 0;
+  program->verified = false;
+}
+
+void vm_next(Program *p)
+{
+  p->instruction = &p->code[p->counter++];
+  p->operandCursor = 0;
+  STATS(_countInstruction(p));
+  byte next = p->instruction->opcode;
+
+  switch (next)
+  {
+  case op_noop:
+    break;
+
+  case op_halt:
+    vm_halt(p);
+    break;
+
+  case op_define:
+    p->counter = _readOperand(p)->number;
+    break;
+
+  case op_restart:
+    os_restart();
+    break;
+
+  case op_debug:
+    vm_toggleDebug(p);
+    break;
+
+  case op_systeminfo:
+    vm_systemInformation(p);
+    break;
+
+  case op_stats:
+    vm_printStats(p);
+    break;
+
+  case op_sleep:
+    vm_sleep(p);
+    break;
+
+  case op_print:
+    _printValue(p, _readValue(p));
+    break;
+
+  case op_dump:
+    vm_dump(p);
+    break;
+
+  case op_declare:
+    vm_declareReference(p);
+    break;
+
+  case op_memget:
+    vm_readFromMemory(p);
+    break;
+
+  case op_memset:
+    vm_writeToMemory(p);
+    break;
+
+  case op_iowrite:
+    vm_ioWrite(p);
+    break;
+
+  case op_ioread:
+    vm_ioRead(p);
+    break;
+
+  case op_iomode:
+    vm_ioMode(p);
+    break;
+
+  case op_iotype:
+    vm_ioType(p);
+    break;
+
+  case op_ioallout:
+    vm_ioAllOut(p);
+    break;
+
+  case op_iointerrupt:
+    vm_ioInterrupt(p);
+    break;
+
+  case op_iointerruptToggle:
+    vm_ioInterruptToggle(p);
+    break;
+
+  case op_delay:
+    vm_delay(p);
+    break;
+
+  case op_yield:
+    vm_yield(p);
+    break;
+
+  case op_jumpto:
+    vm_jumpTo(p);
+    break;
+
+  case op_jumpif:
+    vm_jumpIf(p);
+    break;
+
+  case op_goto:
+    vm_goto(p);
+    break;
+
+  case op_gotoif:
+    vm_gotoIf(p);
+    break;
+
+  case op_return:
+    vm_return(p);
+    break;
+
+  case op_gt:
+  case op_gte:
+  case op_lt:
+  case op_lte:
+  case op_equal:
+  case op_notequal:
+  case op_xor:
+  case op_and:
+  case op_or:
+  case op_add:
+  case op_sub:
+  case op_mul:
+  case op_div:
+  case op_mod:
+    vm_binaryOperation(p, next);
+    break;
+
+  case op_inc:
+  case op_dec:
+    vm_unaryOperation(p, next);
+    break;
+
+  case op_jumpgt:
+  case op_jumpgte:
+  case op_jumplt:
+  case op_jumplte:
+  case op_jumpequal:
+  case op_jumpnotequal:
+    vm_compareAndJump(p, next);
+    break;
+
+  case op_incjumplt:
+    vm_incrementAndJump(p);
+    break;
+
+  case op_addto:
+    vm_addToSlot(p);
+    break;
+
+  case op_not:
+    vm_notOperation(p);
+    break;
+
+  case op_assign:
+    vm_assignOperation(p);
+    break;
+
+  case op_wifistatus:
+    vm_printStationStatus(p);
+    break;
+
+  case op_wifiap:
+    vm_startAccessPoint(p);
+    break;
 
   case op_wificonnect:
     vm_wifiConnect(p);
@@ -819,13 +1961,396 @@ void vm_next(Program *p)
     break;
 
   default:
-    os_printf("[!] Invalid operation: %d\n", next);
-    p->stackTrace();
-    vm_halt(p);
+    vm_invalidOperation(p);
   }
+}
 
-  if (p->counter >= p->endOfTheProgram)
+// Safe path for programs that did not pass program_verify.
+// Returns how much of the instruction budget is left
+uint vm_runChecked(Program *p, uint budget)
+{
+  while (!p->delayTime && !p->paused)
   {
-    vm_halt(p);
+    if (p->counter >= p->instructionCount)
+    {
+      vm_halt(p);
+      return budget;
+    }
+
+    if (budget-- == 0)
+    {
+      vm_preempt(p);
+      return 0;
+    }
+
+    vm_next(p);
+  }
+
+  return budget;
+}
+
+#ifdef WITH_THREADED_DISPATCH
+
+#define DISPATCH()                           \
+  if (p->delayTime || p->paused)             \
+    return budget;                           \
+  if (budget-- == 0)                         \
+  {                                          \
+    vm_preempt(p);                           \
+    return 0;                                \
+  }                                          \
+  p->instruction = &p->code[p->counter++];   \
+  p->operandCursor = 0;                      \
+  STATS(_countInstruction(p));               \
+  goto *p->instruction->handler;
+
+// Direct-threaded engine: every record points to the label of its handler,
+// so each handler jumps straight to the next one.
+// The halt record at the end of the program replaces the end-of-program check
+uint _runVerified(Program *p, uint budget)
+{
+  uint i = 0;
+  Instruction *instruction;
+
+  if (p->code[p->instructionCount].handler == nullptr)
+  {
+    for (; i <= p->instructionCount; i++)
+    {
+      instruction = &p->code[i];
+
+      switch (instruction->opcode)
+      {
+      case op_noop:
+        instruction->handler = &&noop;
+        break;
+      case op_halt:
+        instruction->handler = &&halt;
+        break;
+      case op_define:
+        instruction->handler = &&define;
+        break;
+      case op_restart:
+        instruction->handler = &&restart;
+        break;
+      case op_debug:
+        instruction->handler = &&debug;
+        break;
+      case op_systeminfo:
+        instruction->handler = &&systeminfo;
+        break;
+      case op_stats:
+        instruction->handler = &&stats;
+        break;
+      case op_sleep:
+        instruction->handler = &&sleep;
+        break;
+      case op_print:
+        instruction->handler = &&print;
+        break;
+      case op_dump:
+        instruction->handler = &&dump;
+        break;
+      case op_declare:
+        instruction->handler = &&declare;
+        break;
+      case op_memget:
+        instruction->handler = &&memget;
+        break;
+      case op_memset:
+        instruction->handler = &&memset;
+        break;
+      case op_iowrite:
+        instruction->handler = &&iowrite;
+        break;
+      case op_ioread:
+        instruction->handler = &&ioread;
+        break;
+      case op_iomode:
+        instruction->handler = &&iomode;
+        break;
+      case op_iotype:
+        instruction->handler = &&iotype;
+        break;
+      case op_ioallout:
+        instruction->handler = &&ioallout;
+        break;
+      case op_iointerrupt:
+        instruction->handler = &&iointerrupt;
+        break;
+      case op_iointerruptToggle:
+        instruction->handler = &&iointerruptToggle;
+        break;
+      case op_delay:
+        instruction->handler = &&delay;
+        break;
+      case op_yield:
+        instruction->handler = &&yield;
+        break;
+      case op_jumpto:
+        instruction->handler = &&jumpto;
+        break;
+      case op_jumpif:
+        instruction->handler = &&jumpif;
+        break;
+      case op_goto:
+        instruction->handler = &&goto_;
+        break;
+      case op_gotoif:
+        instruction->handler = &&gotoif;
+        break;
+      case op_return:
+        instruction->handler = &&return_;
+        break;
+      case op_gt:
+      case op_gte:
+      case op_lt:
+      case op_lte:
+      case op_equal:
+      case op_notequal:
+      case op_xor:
+      case op_and:
+      case op_or:
+      case op_add:
+      case op_sub:
+      case op_mul:
+      case op_div:
+      case op_mod:
+        instruction->handler = &&binary;
+        break;
+      case op_inc:
+      case op_dec:
+        instruction->handler = &&unary;
+        break;
+      case op_jumpgt:
+      case op_jumpgte:
+      case op_jumplt:
+      case op_jumplte:
+      case op_jumpequal:
+      case op_jumpnotequal:
+        instruction->handler = &&compareAndJump;
+        break;
+      case op_incjumplt:
+        instruction->handler = &&incrementAndJump;
+        break;
+      case op_addto:
+        instruction->handler = &&addto;
+        break;
+      case op_not:
+        instruction->handler = &&not_;
+        break;
+      case op_assign:
+        instruction->handler = &&assign;
+        break;
+      case op_wifistatus:
+        instruction->handler = &&wifistatus;
+        break;
+      case op_wifiap:
+        instruction->handler = &&wifiap;
+        break;
+      case op_wificonnect:
+        instruction->handler = &&wificonnect;
+        break;
+      case op_wifidisconnect:
+        instruction->handler = &&wifidisconnect;
+        break;
+      case op_wifilist:
+        instruction->handler = &&wifilist;
+        break;
+      case op_i2csetup:
+        instruction->handler = &&i2csetup;
+        break;
+      case op_i2cstart:
+        instruction->handler = &&i2cstart;
+        break;
+      case op_i2cstop:
+        instruction->handler = &&i2cstop;
+        break;
+      case op_i2cwrite:
+        instruction->handler = &&i2cwrite;
+        break;
+      case op_i2cread:
+        instruction->handler = &&i2cread;
+        break;
+      case op_i2cfind:
+        instruction->handler = &&i2cfind;
+        break;
+      default:
+        instruction->handler = &&invalid;
+      }
+    }
+  }
+
+  DISPATCH();
+
+noop:
+  DISPATCH();
+halt:
+  vm_halt(p);
+  DISPATCH();
+define:
+  p->counter = _readOperand(p)->number;
+  DISPATCH();
+restart:
+  os_restart();
+  DISPATCH();
+debug:
+  vm_toggleDebug(p);
+  DISPATCH();
+systeminfo:
+  vm_systemInformation(p);
+  DISPATCH();
+stats:
+  vm_printStats(p);
+  DISPATCH();
+sleep:
+  vm_sleep(p);
+  DISPATCH();
+print:
+  _printValue(p, _readValue(p));
+  DISPATCH();
+dump:
+  vm_dump(p);
+  DISPATCH();
+declare:
+  vm_declareReference(p);
+  DISPATCH();
+memget:
+  vm_readFromMemory(p);
+  DISPATCH();
+memset:
+  vm_writeToMemory(p);
+  DISPATCH();
+iowrite:
+  vm_ioWrite(p);
+  DISPATCH();
+ioread:
+  vm_ioRead(p);
+  DISPATCH();
+iomode:
+  vm_ioMode(p);
+  DISPATCH();
+iotype:
+  vm_ioType(p);
+  DISPATCH();
+ioallout:
+  vm_ioAllOut(p);
+  DISPATCH();
+iointerrupt:
+  vm_ioInterrupt(p);
+  DISPATCH();
+iointerruptToggle:
+  vm_ioInterruptToggle(p);
+  DISPATCH();
+delay:
+  vm_delay(p);
+  DISPATCH();
+yield:
+  vm_yield(p);
+  DISPATCH();
+jumpto:
+  vm_jumpTo(p);
+  DISPATCH();
+jumpif:
+  vm_jumpIf(p);
+  DISPATCH();
+goto_:
+  vm_goto(p);
+  DISPATCH();
+gotoif:
+  vm_gotoIf(p);
+  DISPATCH();
+return_:
+  vm_return(p);
+  DISPATCH();
+binary:
+  vm_binaryOperation(p, p->instruction->opcode);
+  DISPATCH();
+unary:
+  vm_unaryOperation(p, p->instruction->opcode);
+  DISPATCH();
+compareAndJump:
+  vm_compareAndJump(p, p->instruction->opcode);
+  DISPATCH();
+incrementAndJump:
+  vm_incrementAndJump(p);
+  DISPATCH();
+addto:
+  vm_addToSlot(p);
+  DISPATCH();
+not_:
+  vm_notOperation(p);
+  DISPATCH();
+assign:
+  vm_assignOperation(p);
+  DISPATCH();
+wifistatus:
+  vm_printStationStatus(p);
+  DISPATCH();
+wifiap:
+  vm_startAccessPoint(p);
+  DISPATCH();
+wificonnect:
+  vm_wifiConnect(p);
+  DISPATCH();
+wifidisconnect:
+  vm_wifiDisconnect(p);
+  DISPATCH();
+wifilist:
+  vm_wifiList(p);
+  DISPATCH();
+i2csetup:
+  vm_i2csetup(p);
+  DISPATCH();
+i2cstart:
+  vm_i2cstart(p);
+  DISPATCH();
+i2cstop:
+  vm_i2cstop(p);
+  DISPATCH();
+i2cwrite:
+  vm_i2cwrite(p);
+  DISPATCH();
+i2cread:
+  vm_i2cread(p);
+  DISPATCH();
+i2cfind:
+  vm_i2cfind(p);
+  DISPATCH();
+invalid:
+  vm_invalidOperation(p);
+  DISPATCH();
+}
+
+#undef DISPATCH
+
+#else
+
+// Verified programs end on the halt record at the end of the program,
+// so this loop needs no end-of-program check
+uint _runVerified(Program *p, uint budget)
+{
+  while (!p->delayTime && !p->paused)
+  {
+    if (budget-- == 0)
+    {
+      vm_preempt(p);
+      return 0;
+    }
+
+    vm_next(p);
   }
+
+  return budget;
+}
+
+#endif
+
+// Run until the program yields, delays, halts or uses its instruction budget
+void vm_run(Program *p)
+{
+  uint budget = p->instructionBudget;
+  uint left = p->verified ? _runVerified(p, budget) : vm_runChecked(p, budget);
+
+  p->instructionsRun += budget - left;
+  STATS(_stopCounting(p));
 }
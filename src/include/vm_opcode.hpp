@@ -12,6 +12,9 @@
 #define op_jumpif 0x0b
 #define op_sleep 0x0c
 #define op_return 0x0d
+#define op_stats 0x0e
+#define op_goto 0x10
+#define op_gotoif 0x11
 
 // operators [0x20..0x3f]
 // binary operations
@@ -39,6 +42,16 @@
 #define op_declare 0x32
 #define op_define 0x33
 
+// fused operations
+#define op_jumpgt 0x34
+#define op_jumpgte 0x35
+#define op_jumplt 0x36
+#define op_jumplte 0x37
+#define op_jumpequal 0x38
+#define op_jumpnotequal 0x39
+#define op_incjumplt 0x3a
+#define op_addto 0x3b
+
 // memory/io instructions [0x40..0x5f]
 #define op_memget 0x40
 #define op_memset 0x41
@@ -0,0 +1,379 @@
+#ifdef WITH_OPTIMIZER
+
+// How a program writes to each slot
+typedef struct
+{
+  byte writes;
+  bool onlyIntegers;
+  uint declaration;
+} SlotUsage;
+
+bool _isConstant(Operand *operand)
+{
+  return operand->type == vt_byte || operand->type == vt_integer;
+}
+
+bool _isBinaryOperation(byte opcode)
+{
+  return opcode >= op_gt && opcode <= op_mod;
+}
+
+bool _hasOperand(const char *signature, char kind)
+{
+  for (; signature && *signature; signature++)
+  {
+    if (*signature == kind)
+      return true;
+  }
+
+  return false;
+}
+
+uint _wireLength(Program *p, uint position)
+{
+  return p->code[position + 1].offset - p->code[position].offset;
+}
+
+// Instructions before the first jump, call or function always run
+// in order, once, before anything else in the program
+uint MOVE_TO_FLASH _entryLength(Program *p)
+{
+  uint i = 0;
+
+  for (; i < p->instructionCount; i++)
+  {
+    const char *signature = _signatureOf(p->code[i].opcode);
+    byte opcode = p->code[i].opcode;
+
+    if (opcode == op_return || opcode == op_halt || _hasOperand(signature, 'T') || _hasOperand(signature, 'L'))
+      break;
+  }
+
+  return i;
+}
+
+void MOVE_TO_FLASH _collectSlotUsage(Program *p, SlotUsage *usage)
+{
+  uint i = 0;
+
+  for (i = 0; i < MAX_SLOTS; i++)
+  {
+    usage[i].onlyIntegers = true;
+    usage[i].declaration = p->instructionCount;
+  }
+
+  for (i = 0; i < p->instructionCount; i++)
+  {
+    Instruction *instruction = &p->code[i];
+    const char *signature = _signatureOf(instruction->opcode);
+
+    for (int j = 0; signature[j]; j++)
+    {
+      if (signature[j] != 'I')
+        continue;
+
+      SlotUsage *slot = &usage[instruction->operands[j].number];
+      Operand *value = &instruction->operands[j + 1];
+
+      if (slot->writes < 255)
+        slot->writes++;
+
+      switch (instruction->opcode)
+      {
+      case op_declare:
+        slot->declaration = i;
+        // fall through
+      case op_assign:
+        slot->onlyIntegers = slot->onlyIntegers && value->type == vt_integer;
+        break;
+
+      case op_memget:
+      case op_i2cread:
+      case op_i2cfind:
+        slot->onlyIntegers = false;
+        break;
+      }
+    }
+  }
+}
+
+// Slots declared once with a constant in the entry of the program, and never
+// written again, are replaced by their value everywhere after the declaration.
+// Those slots are marked in p->optimization, see program_writesConstant
+uint MOVE_TO_FLASH _propagateConstants(Program *p, SlotUsage *usage)
+{
+  uint entry = _entryLength(p);
+  uint replaced = 0;
+  uint i = 0;
+
+  for (; i < p->instructionCount; i++)
+  {
+    Instruction *instruction = &p->code[i];
+    const char *signature = _signatureOf(instruction->opcode);
+
+    for (int j = 0; signature[j]; j++)
+    {
+      Operand *operand = &instruction->operands[j];
+
+      if (signature[j] == 'I' || operand->type != vt_identifier)
+        continue;
+
+      SlotUsage *slot = &usage[operand->number];
+
+      if (slot->writes != 1 || slot->declaration >= entry || slot->declaration >= i)
+        continue;
+
+      Operand *constant = &p->code[slot->declaration].operands[1];
+
+      if (!_isConstant(constant))
+        continue;
+
+      p->optimization.propagated[operand->number / 32] |= 1u << (operand->number % 32);
+      *operand = *constant;
+      replaced++;
+    }
+  }
+
+  return replaced;
+}
+
+// A binary operation on two constants becomes an assignment of the result,
+// when the target slot only ever holds integers
+uint MOVE_TO_FLASH _foldConstants(Program *p, SlotUsage *usage, uint *bytes)
+{
+  uint folded = 0;
+  uint i = 0;
+
+  for (; i < p->instructionCount; i++)
+  {
+    Instruction *instruction = &p->code[i];
+    Operand *operands = instruction->operands;
+
+    if (!_isBinaryOperation(instruction->opcode) || !_isConstant(&operands[1]) || !_isConstant(&operands[2]))
+      continue;
+
+    if (!usage[operands[0].number].onlyIntegers)
+      continue;
+
+    if ((instruction->opcode == op_div || instruction->opcode == op_mod) && operands[2].number == 0)
+      continue;
+
+    operands[1].number = _operate(instruction->opcode, operands[1].number, operands[2].number);
+    operands[1].type = vt_integer;
+    operands[2].type = vt_null;
+    operands[2].number = 0;
+    instruction->opcode = op_assign;
+
+    // assign $slot, integer: 1 + 2 + 5 bytes, which can be more than a packed operation
+    if (_wireLength(p, i) > 8)
+      *bytes += _wireLength(p, i) - 8;
+
+    folded++;
+  }
+
+  return folded;
+}
+
+// Jumps on a constant condition become plain jumps or are removed
+void MOVE_TO_FLASH _foldConditions(Program *p)
+{
+  uint i = 0;
+
+  for (; i < p->instructionCount; i++)
+  {
+    Instruction *instruction = &p->code[i];
+    Operand *operands = instruction->operands;
+    bool taken;
+
+    switch (instruction->opcode)
+    {
+    case op_jumpif:
+    case op_gotoif:
+      if (!_isConstant(&operands[0]))
+        continue;
+
+      taken = operands[0].number != 0;
+      operands[0] = operands[1];
+      instruction->opcode = instruction->opcode == op_jumpif ? op_jumpto : op_goto;
+      break;
+
+    case op_jumpgt:
+    case op_jumpgte:
+    case op_jumplt:
+    case op_jumplte:
+    case op_jumpequal:
+    case op_jumpnotequal:
+      if (!_isConstant(&operands[0]) || !_isConstant(&operands[1]))
+        continue;
+
+      taken = _operate(instruction->opcode - op_jumpgt + op_gt, operands[0].number, operands[1].number);
+      operands[0] = operands[2];
+      instruction->opcode = op_goto;
+      break;
+
+    default:
+      continue;
+    }
+
+    if (!taken)
+    {
+      instruction->opcode = op_noop;
+    }
+  }
+}
+
+// Follow noops and gotos to where a jump really lands, or to the first function on the way
+uint MOVE_TO_FLASH _finalTarget(Program *p, uint position)
+{
+  uint hops = 0;
+
+  while (position < p->instructionCount && hops++ < p->instructionCount)
+  {
+    if (_isFunction(p, position))
+      break;
+
+    if (p->code[position].opcode == op_noop)
+    {
+      position++;
+      continue;
+    }
+
+    if (p->code[position].opcode != op_goto)
+      break;
+
+    position = p->code[position].operands[0].number;
+  }
+
+  return position;
+}
+
+void MOVE_TO_FLASH _threadJumps(Program *p)
+{
+  uint i = 0;
+
+  for (; i < p->instructionCount; i++)
+  {
+    Operand *target = _targetOf(&p->code[i]);
+
+    if (target == nullptr)
+      continue;
+
+    target->number = _finalTarget(p, target->number);
+
+    if (p->code[i].opcode == op_goto && target->number == _finalTarget(p, i + 1))
+    {
+      p->code[i].opcode = op_noop;
+    }
+  }
+}
+
+// Drop every noop that is not the start of a function, and move jump targets to the
+// instructions that remain
+uint MOVE_TO_FLASH _removeNoops(Program *p, uint *bytes)
+{
+  uint *positions = (uint *)_allocate(p, (p->instructionCount + 1) * sizeof(uint));
+  uint count = 0;
+  uint i = 0;
+
+  for (; i <= p->instructionCount; i++)
+  {
+    positions[i] = count;
+
+    if (i == p->instructionCount || p->code[i].opcode != op_noop || _isFunction(p, i))
+    {
+      count++;
+      continue;
+    }
+
+    *bytes += _wireLength(p, i);
+  }
+
+  for (i = 0; i <= p->instructionCount; i++)
+  {
+    Instruction *instruction = &p->code[i];
+    const char *signature = _signatureOf(instruction->opcode);
+
+    if (i < p->instructionCount && instruction->opcode == op_noop && !_isFunction(p, i))
+      continue;
+
+    for (int j = 0; signature && signature[j]; j++)
+    {
+      if (signature[j] == 'T' || signature[j] == 'L')
+        instruction->operands[j].number = positions[instruction->operands[j].number];
+    }
+
+    p->code[positions[i]] = *instruction;
+  }
+
+  for (i = 0; i < p->functionCount; i++)
+  {
+    p->functions[i] = positions[p->functions[i]];
+  }
+
+  uint removed = p->instructionCount + 1 - count;
+  p->instructionCount = count - 1;
+  os_free(positions);
+
+  return removed;
+}
+
+// Optional pass over a decoded program: constant propagation and folding,
+// jump threading and removal of noops. Jump targets are moved to match,
+// and what it saved is kept in p->optimization for stats and systeminfo
+void MOVE_TO_FLASH program_optimize(Program *p)
+{
+  SlotUsage *usage = (SlotUsage *)_allocate(p, MAX_SLOTS * sizeof(SlotUsage));
+  uint bytes = 0;
+  uint folded;
+  uint removed;
+
+  _collectSlotUsage(p, usage);
+  folded = _propagateConstants(p, usage);
+  folded += _foldConstants(p, usage, &bytes);
+  _foldConditions(p);
+  _threadJumps(p);
+  removed = _removeNoops(p, &bytes);
+  os_free(usage);
+
+  if (removed)
+  {
+    p->code = (Instruction *)_reallocate(p, p->code, (p->instructionCount + 1) * sizeof(Instruction));
+  }
+
+  p->optimization.folded = folded;
+  p->optimization.removedInstructions = removed;
+  p->optimization.removedBytes = bytes;
+}
+
+// The first slot that `count` records write and that the optimizer replaced with its value
+// in the program, or -1. The program would not see what they write there
+int MOVE_TO_FLASH program_writesConstant(Program *p, Instruction *code, uint count)
+{
+  for (uint i = 0; i < count; i++)
+  {
+    const char *signature = _signatureOf(code[i].opcode);
+
+    for (int j = 0; signature && signature[j]; j++)
+    {
+      uint slot = code[i].operands[j].number;
+
+      if (signature[j] == 'I' && (p->optimization.propagated[slot / 32] & (1u << (slot % 32))))
+        return slot;
+    }
+  }
+
+  return -1;
+}
+
+#else
+
+void program_optimize(Program *p)
+{
+}
+
+int program_writesConstant(Program *p, Instruction *code, uint count)
+{
+  return -1;
+}
+
+#endif
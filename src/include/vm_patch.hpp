@@ -0,0 +1,277 @@
+#ifdef WITH_PATCH
+
+// Hot patches: new code is appended to a running program, and every jump to the function
+// it replaces goes to the new code instead. Slots, interrupt handlers, the call stack and
+// the counter are kept: a call that is running when the patch comes finishes in the old code.
+// A patch is
+//   4 bytes LE: offset of the function it replaces, or PATCH_APPEND to only add code
+//   4 bytes LE: offset its code starts at, one after the end of the code it patches
+//   its code, encoded like the program, with jump targets in the patched program
+// A halt ends the old code before the patch, so nothing runs into it
+#define PATCH_APPEND 0xffffffff
+#define PATCH_HEADER 8
+
+void _moveOperand(Operand *operand, byteref from, uint length, byteref to)
+{
+  if (_hasData(operand) && operand->data >= from && operand->data < from + length)
+  {
+    operand->data = to + (operand->data - from);
+  }
+}
+
+// Strings and blobs of the records, the constants and the slots point into the image
+void MOVE_TO_FLASH _moveImage(Program *p, byteref from, uint length, byteref to)
+{
+  uint i;
+
+  for (i = 0; i < p->instructionCount * MAX_OPERANDS; i++)
+  {
+    _moveOperand(&p->code[i / MAX_OPERANDS].operands[i % MAX_OPERANDS], from, length, to);
+  }
+
+  for (i = 0; i < p->poolSize; i++)
+  {
+    _moveOperand(&p->pool[i], from, length, to);
+  }
+
+  for (i = 0; i < MAX_SLOTS; i++)
+  {
+    p->slots[i].move(from, length, to);
+  }
+}
+
+// The function that starts at `offset`, or the count of records if there is none
+uint _functionAt(Program *p, uint offset)
+{
+  for (uint i = 0; i < p->functionCount; i++)
+  {
+    if (p->code[p->functions[i]].offset == offset)
+      return p->functions[i];
+  }
+
+  return p->instructionCount;
+}
+
+// Send every jump, function and interrupt handler at record `from` to record `to`
+void MOVE_TO_FLASH _redirect(Program *p, uint from, uint to)
+{
+  uint i;
+
+  for (i = 0; i < p->instructionCount; i++)
+  {
+    const char *signature = _signatureOf(p->code[i].opcode);
+
+    for (int j = 0; signature != nullptr && signature[j]; j++)
+    {
+      if (signature[j] == 'T' && p->code[i].operands[j].number == from)
+        p->code[i].operands[j].number = to;
+    }
+  }
+
+  for (i = 0; i < p->functionCount; i++)
+  {
+    if (p->functions[i] == from)
+      p->functions[i] = to;
+  }
+
+  for (i = 0; i < NUMBER_OF_PINS; i++)
+  {
+    if (p->interruptHandlers[i] == from)
+      p->interruptHandlers[i] = to;
+  }
+}
+
+// The record at an offset, or the one after it if the optimizer removed that one
+uint _recordFrom(Program *p, uint offset)
+{
+  uint i = 0;
+
+  while (i < p->instructionCount && p->code[i].offset < offset)
+    i++;
+
+  return i;
+}
+
+// Decode the records of a patched program again and optimize them with the writes of
+// the patch, which the values the optimizer put in place of slots did not count.
+// The counter, the call stack, interrupt handlers and functions stay at their offsets
+void MOVE_TO_FLASH _reoptimize(Program *p)
+{
+  uint i;
+
+  p->counter = p->code[p->counter].offset;
+
+  for (i = 0; i < (uint)p->callStackCursor; i++)
+  {
+    p->callStack[i] = p->code[p->callStack[i]].offset;
+  }
+
+  for (i = 0; i < NUMBER_OF_PINS; i++)
+  {
+    if (p->interruptHandlers[i])
+      p->interruptHandlers[i] = p->code[p->interruptHandlers[i]].offset;
+  }
+
+  // _resolveTargets takes functions as offsets, like the table of a packed program
+  for (i = 0; i < p->functionCount; i++)
+  {
+    p->functions[i] = p->code[p->functions[i]].offset;
+  }
+
+  os_free(p->code);
+  p->instructionCount = _decodeProgram(p, nullptr);
+  p->code = (Instruction *)_allocate(p, (p->instructionCount + 1) * sizeof(Instruction));
+  _decodeProgram(p, p->code);
+  p->code[p->instructionCount].opcode = op_halt;
+  p->code[p->instructionCount].offset = p->endOfTheProgram;
+  _resolveTargets(p);
+  _collectFunctions(p);
+  _eliminateTailCalls(p);
+  os_memset(&p->optimization, 0, sizeof(Optimization));
+  program_optimize(p);
+
+  p->counter = _recordFrom(p, p->counter);
+
+  for (i = 0; i < (uint)p->callStackCursor; i++)
+  {
+    p->callStack[i] = _recordFrom(p, p->callStack[i]);
+  }
+
+  for (i = 0; i < NUMBER_OF_PINS; i++)
+  {
+    if (p->interruptHandlers[i])
+      p->interruptHandlers[i] = _recordFrom(p, p->interruptHandlers[i]);
+  }
+}
+
+// Apply a patch to a running program. Returns an error, or nullptr if it was applied.
+// A patch that is not valid leaves the program as it was
+const char *MOVE_TO_FLASH program_patch(Program *p, byteref patch, uint length)
+{
+  uint function;
+  uint start;
+  uint end = p->endOfTheProgram;
+  uint header = p->bytes - p->image;
+  uint total = end + 1 + length - PATCH_HEADER;
+  uint count = 0;
+  uint oldCount = p->instructionCount;
+  uint replaced;
+  int cursor;
+  uint i;
+  byteref image;
+  Instruction *code;
+  Instruction instruction;
+  const char *error = nullptr;
+
+  if (length < PATCH_HEADER || !p->verified || p->code == nullptr)
+    return "no program to patch";
+
+  function = _decodeInteger(patch);
+  start = _decodeInteger(patch + 4);
+  replaced = function == PATCH_APPEND ? oldCount : _functionAt(p, function);
+
+  if (start != end + 1)
+    return "patch is for another version of the program";
+
+  if (function != PATCH_APPEND && replaced == oldCount)
+    return "no function at that offset";
+
+  image = (byteref)_allocate(p, _wordSize(header + total));
+
+  for (i = 0; i < header + end; i++)
+  {
+    image[i] = _byteAt(p->image, i);
+  }
+
+  image[header + end] = op_halt;
+  os_memcpy(image + header + start, patch + PATCH_HEADER, length - PATCH_HEADER);
+
+  // the halt and the new instructions
+  for (cursor = end; cursor < (int)total && cursor != -1; count++)
+  {
+    cursor = _decodeInstruction(p, image + header, cursor, total, &instruction);
+  }
+
+  if (cursor == -1)
+  {
+    os_free(image);
+    return "operand past the end of the patch";
+  }
+
+  code = (Instruction *)_allocate(p, (oldCount + count + 1) * sizeof(Instruction));
+  os_memcpy(code, p->code, oldCount * sizeof(Instruction));
+
+  for (i = oldCount, cursor = end; i < oldCount + count; i++)
+  {
+    cursor = _decodeInstruction(p, image + header, cursor, total, &code[i]);
+  }
+
+  code[oldCount + count].opcode = op_halt;
+  code[oldCount + count].offset = total;
+
+  // check the new instructions against the patched program, then keep it or go back
+  byteref oldImage = p->image;
+  byteref oldBytes = p->bytes;
+  uint oldImageLength = p->imageLength;
+  Instruction *oldCode = p->code;
+
+  p->image = image;
+  p->bytes = image + header;
+  p->imageLength = header + total;
+  p->endOfTheProgram = total;
+  p->code = code;
+  p->instructionCount = oldCount + count;
+
+  for (i = oldCount; i < p->instructionCount && error == nullptr; i++)
+  {
+    error = _verifyInstruction(p, &code[i], code[i + 1].offset);
+  }
+
+  if (error != nullptr)
+  {
+    p->image = oldImage;
+    p->bytes = oldBytes;
+    p->imageLength = oldImageLength;
+    p->endOfTheProgram = end;
+    p->code = oldCode;
+    p->instructionCount = oldCount;
+    os_free(image);
+    os_free(code);
+    return error;
+  }
+
+  // the profiler samples the current record from a timer
+  p->instruction = nullptr;
+  _moveImage(p, oldImage, oldImageLength, image);
+
+  if (!p->imageInFlash)
+    os_free(oldImage);
+
+  os_free(oldCode);
+  p->imageInFlash = false;
+
+  for (i = oldCount; i < p->instructionCount; i++)
+  {
+    _resolveInstruction(p, i);
+  }
+
+  // the old code reads values the optimizer put in place of slots the patch writes
+  if (program_writesConstant(p, code + oldCount, count) != -1)
+  {
+    _reoptimize(p);
+    replaced = function == PATCH_APPEND ? p->instructionCount : _functionAt(p, function);
+  }
+
+  if (function != PATCH_APPEND)
+  {
+    _redirect(p, replaced, _recordFrom(p, start));
+  }
+
+  // functions the new code calls can be patched later
+  _collectFunctions(p);
+  _eliminateTailCalls(p);
+
+  return nullptr;
+}
+
+#endif
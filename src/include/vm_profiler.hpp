@@ -0,0 +1,245 @@
+#ifdef WITH_PROFILER
+
+// Sampling profiler: a timer interrupt records which instruction runs, and the calls
+// around it, without touching the loop of the VM. The chip samples from a hardware
+// timer, the host from the CPU time of the process.
+// Interval between samples, in microseconds
+#ifndef PROFILE_INTERVAL
+#define PROFILE_INTERVAL 1000
+#endif
+
+// the program in the middle of a tick, if any
+static Program *volatile profiledProgram = nullptr;
+static volatile uint idleSamples = 0;
+
+uint _profileHash(uint position, uint depth, uint *callers)
+{
+  uint hash = position * 31 + depth;
+
+  for (int i = 0; i < PROFILE_STACK_DEPTH; i++)
+  {
+    hash = hash * 31 + callers[i];
+  }
+
+  return hash % MAX_PROFILE_ENTRIES;
+}
+
+bool _sameSample(ProfileEntry *entry, uint position, uint depth, uint *callers)
+{
+  if (entry->position != position || entry->depth != depth)
+    return false;
+
+  for (int i = 0; i < PROFILE_STACK_DEPTH; i++)
+  {
+    if (entry->callers[i] != callers[i])
+      return false;
+  }
+
+  return true;
+}
+
+// Runs in the timer interrupt: no allocations, no output
+void profiler_sample()
+{
+  Program *p = profiledProgram;
+  uint callers[PROFILE_STACK_DEPTH] = {0};
+
+  if (p == nullptr || p->profile == nullptr || p->instruction == nullptr)
+  {
+    idleSamples++;
+    return;
+  }
+
+  Profile *profile = p->profile;
+  uint position = p->instruction - p->code;
+  uint depth = p->callStackCursor;
+
+  for (uint i = 0; i < depth && i < PROFILE_STACK_DEPTH; i++)
+  {
+    callers[i] = p->callStack[depth - 1 - i];
+  }
+
+  profile->samples++;
+
+  for (uint i = 0, slot = _profileHash(position, depth, callers); i < MAX_PROFILE_ENTRIES; i++)
+  {
+    ProfileEntry *entry = &profile->entries[(slot + i) % MAX_PROFILE_ENTRIES];
+
+    if (entry->count == 0)
+    {
+      entry->position = position;
+      entry->depth = depth;
+      os_memcpy(entry->callers, callers, sizeof(callers));
+    }
+    else if (!_sameSample(entry, position, depth, callers))
+    {
+      continue;
+    }
+
+    entry->count++;
+    return;
+  }
+
+  profile->dropped++;
+}
+
+void MOVE_TO_FLASH profiler_start(uint interval)
+{
+  os_profiler_arm(&profiler_sample, interval);
+}
+
+void MOVE_TO_FLASH profiler_stop()
+{
+  os_profiler_disarm();
+}
+
+void profiler_enter(Program *p)
+{
+  if (p->profile == nullptr)
+  {
+    p->profile = (Profile *)_allocate(p, sizeof(Profile));
+  }
+
+  profiledProgram = p;
+}
+
+void profiler_leave(Program *p)
+{
+  profiledProgram = nullptr;
+}
+
+// positions change with a new program
+void profiler_clear(Program *p)
+{
+  if (p->profile != nullptr)
+  {
+    os_memset(p->profile, 0, sizeof(Profile));
+  }
+}
+
+// First record of the function that holds a record: the innermost `def` around it.
+// Programs without `def` use the targets of their calls, and each function
+// runs up to the next one. Returns -1 outside of functions
+int MOVE_TO_FLASH _functionOf(Program *p, uint position)
+{
+  int start = -1;
+  bool hasDefinitions = false;
+  uint i;
+
+  for (i = 0; i < p->instructionCount; i++)
+  {
+    Instruction *instruction = &p->code[i];
+
+    if (instruction->opcode != op_define)
+      continue;
+
+    hasDefinitions = true;
+
+    if (i < position && position < instruction->operands[0].number)
+      start = i + 1;
+  }
+
+  if (hasDefinitions)
+    return start;
+
+  for (i = 0; i < p->instructionCount; i++)
+  {
+    Instruction *instruction = &p->code[i];
+    uint target = instruction->operands[instruction->opcode == op_jumpif ? 1 : 0].number;
+
+    if ((instruction->opcode == op_jumpto || instruction->opcode == op_jumpif) && target <= position &&
+        (int)target > start)
+      start = target;
+  }
+
+  return start;
+}
+
+void MOVE_TO_FLASH _printFrame(Program *p, uint position)
+{
+  int function = position <= p->instructionCount ? _functionOf(p, position) : -1;
+
+  if (function == -1)
+  {
+    _printf(p, ";main");
+    return;
+  }
+
+  _printf(p, ";fn@%d", _offsetOf(p, function));
+}
+
+// Print the samples in collapsed stacks, one line per stack with its count, as flame graph
+// tools read them: `task0;main;fn@9;@27 120`. The last frame is the offset of the
+// instruction, calls deeper than PROFILE_STACK_DEPTH are shown as `...`
+void MOVE_TO_FLASH profiler_print(Program *p, const char *root)
+{
+  Profile *profile = p->profile;
+
+  if (profile == nullptr)
+    return;
+
+  for (uint i = 0; i < MAX_PROFILE_ENTRIES; i++)
+  {
+    ProfileEntry *entry = &profile->entries[i];
+    uint depth = entry->depth < PROFILE_STACK_DEPTH ? entry->depth : PROFILE_STACK_DEPTH;
+
+    if (entry->count == 0)
+      continue;
+
+    _printf(p, "%s", root);
+
+    if (entry->depth > PROFILE_STACK_DEPTH)
+      _printf(p, ";...");
+
+    // each caller runs in the function of the call before its return position
+    for (uint j = depth; j > 0; j--)
+    {
+      _printFrame(p, entry->callers[j - 1] - 1);
+    }
+
+    _printFrame(p, entry->position);
+    _printf(p, ";@%d %d\n", _offsetOf(p, entry->position), entry->count);
+  }
+
+  if (profile->dropped)
+    _printf(p, "%s;[dropped] %d\n", root, profile->dropped);
+}
+
+// Samples of every task with a program to a report, with the task as the root frame
+void MOVE_TO_FLASH profiler_printTasks(Report *report)
+{
+  char root[8];
+  char idle[24];
+
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    if (tasks[i].instructionCount == 0)
+      continue;
+
+    os_sprintf(root, "task%d", i);
+    tasks[i].report = report;
+    profiler_print(&tasks[i], root);
+    tasks[i].report = nullptr;
+  }
+
+  if (idleSamples)
+  {
+    report_write(report, idle, os_sprintf(idle, "idle %d\n", idleSamples));
+  }
+}
+
+#else
+
+void profiler_enter(Program *p)
+{
+}
+
+void profiler_leave(Program *p)
+{
+}
+
+void profiler_clear(Program *p)
+{
+}
+
+#endif
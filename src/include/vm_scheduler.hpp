@@ -0,0 +1,143 @@
+// Several programs can run on one chip, each one with its own slots, call stack and counter.
+// Every task ticks on its own timer: it runs until it yields, delays or uses its
+// instruction budget, and the SDK runs the other tasks before it comes back.
+// Each task takes about 3.5kb of RAM
+#ifndef MAX_TASKS
+#define MAX_TASKS 4
+#endif
+
+static Program tasks[MAX_TASKS];
+
+Program *scheduler_task(int id)
+{
+  if (id < 0 || id >= MAX_TASKS)
+  {
+    return nullptr;
+  }
+
+  return &tasks[id];
+}
+
+void scheduler_setup(send_callback onSend, halt_callback onHalt)
+{
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    tasks[i].onSend = onSend;
+    tasks[i].onHalt = onHalt;
+  }
+}
+
+// Replace the program of a task. The other tasks keep running
+bool MOVE_TO_FLASH scheduler_load(int id, byteref bytes, int length)
+{
+  Program *task = scheduler_task(id);
+
+  if (task == nullptr)
+  {
+    return false;
+  }
+
+  os_timer_disarm(&task->timer);
+  return program_load(task, bytes, length);
+}
+
+// Like scheduler_load, with bytes the task keeps, see program_loadImage
+bool MOVE_TO_FLASH scheduler_loadImage(int id, byteref image, int length)
+{
+  Program *task = scheduler_task(id);
+
+  if (task == nullptr)
+  {
+    os_free(image);
+    return false;
+  }
+
+  os_timer_disarm(&task->timer);
+  return program_loadImage(task, image, length);
+}
+
+// Like scheduler_load, for a program in mapped flash, see program_loadInPlace
+bool MOVE_TO_FLASH scheduler_loadInPlace(int id, byteref image, int length)
+{
+  Program *task = scheduler_task(id);
+
+  if (task == nullptr)
+  {
+    return false;
+  }
+
+  os_timer_disarm(&task->timer);
+  return program_loadInPlace(task, image, length);
+}
+
+#ifdef WITH_PATCH
+// Patch the program of a task where it runs, see program_patch
+const char *MOVE_TO_FLASH scheduler_patch(int id, byteref patch, int length)
+{
+  Program *task = scheduler_task(id);
+
+  if (task == nullptr)
+  {
+    return "no task";
+  }
+
+  return program_patch(task, patch, length);
+}
+#endif
+
+#ifdef WITH_EVAL
+// Run a fragment inside the program of a task, see program_eval
+const char *MOVE_TO_FLASH scheduler_eval(int id, byteref fragment, int length, char *output, uint *outputLength)
+{
+  Program *task = scheduler_task(id);
+
+  *outputLength = 0;
+
+  if (task == nullptr)
+  {
+    return "no task";
+  }
+
+  return program_eval(task, fragment, length, output, outputLength);
+}
+#endif
+
+bool MOVE_TO_FLASH scheduler_stop(int id)
+{
+  Program *task = scheduler_task(id);
+
+  if (task == nullptr)
+  {
+    return false;
+  }
+
+  os_timer_disarm(&task->timer);
+  task->paused = true;
+  task->flush();
+  return true;
+}
+
+// Send the output that waits in every task, once the transport has room again
+void scheduler_flush()
+{
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    tasks[i].flush();
+  }
+}
+
+// Print the stats of every task with a program to a report, which can be longer
+// than the output ring of a task
+void MOVE_TO_FLASH scheduler_printStats(Report *report)
+{
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    if (tasks[i].instructionCount == 0)
+      continue;
+
+    tasks[i].report = report;
+    _printf(&tasks[i], "Task %d\n", i);
+    vm_printStats(&tasks[i]);
+    tasks[i].report = nullptr;
+  }
+}
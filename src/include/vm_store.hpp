@@ -0,0 +1,251 @@
+#ifdef WITH_STORE
+
+// Program store: programs kept in flash, found by the hash of their bytes, so they
+// survive a restart and a client can run one again without uploading it.
+// The first sector holds the index, each program starts on a sector of its own after it.
+// Programs a task should run after a restart are marked in the index, see store_boot
+#ifndef STORE_ADDRESS
+#define STORE_ADDRESS 0xd0000
+#endif
+
+#ifndef STORE_SECTORS
+#define STORE_SECTORS 32
+#endif
+
+#define STORE_ENTRIES 16
+#define STORE_MAGIC 0x31534248
+
+typedef struct
+{
+  uint32 hash;
+  uint32 address;
+  uint32 length;
+} StoreEntry;
+
+// Hash 0 is an empty entry, or no program to start
+typedef struct
+{
+  uint32 magic;
+  uint32 autostart[MAX_TASKS];
+  StoreEntry entries[STORE_ENTRIES];
+} StoreIndex;
+
+static StoreIndex storeIndex;
+
+// FNV-1a, which clients compute to ask for a program before they send it.
+// Reads in words, for programs in mapped flash
+uint32 store_hash(byteref bytes, uint length)
+{
+  uint32 hash = 2166136261u;
+
+  for (uint i = 0; i < length; i++)
+  {
+    hash = (hash ^ _byteAt(bytes, i)) * 16777619u;
+  }
+
+  return hash;
+}
+
+uint _storeSectors(uint length)
+{
+  return (length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+}
+
+bool MOVE_TO_FLASH _storeWriteIndex()
+{
+  return os_flash_erase(STORE_ADDRESS / FLASH_SECTOR_SIZE) &&
+         os_flash_write(STORE_ADDRESS, &storeIndex, sizeof(StoreIndex));
+}
+
+// Read the index, or start an empty one on flash that has none
+void MOVE_TO_FLASH store_open()
+{
+  if (os_flash_read(STORE_ADDRESS, &storeIndex, sizeof(StoreIndex)) && storeIndex.magic == STORE_MAGIC)
+  {
+    return;
+  }
+
+  os_memset(&storeIndex, 0, sizeof(StoreIndex));
+  storeIndex.magic = STORE_MAGIC;
+  _storeWriteIndex();
+}
+
+StoreEntry *_storeFind(uint32 hash)
+{
+  for (int i = 0; i < STORE_ENTRIES; i++)
+  {
+    if (hash != 0 && storeIndex.entries[i].hash == hash)
+      return &storeIndex.entries[i];
+  }
+
+  return nullptr;
+}
+
+bool store_has(uint32 hash)
+{
+  return _storeFind(hash) != nullptr;
+}
+
+bool _storeIsAutostart(uint32 hash)
+{
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    if (storeIndex.autostart[i] == hash)
+      return true;
+  }
+
+  return false;
+}
+
+// A task that was loaded with store_load runs from the sectors of the entry
+bool _storeIsRunning(StoreEntry *entry)
+{
+  byteref image = os_flash_map(entry->address);
+
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    Program *task = scheduler_task(i);
+
+    if (task->imageInFlash && task->image == image)
+      return true;
+  }
+
+  return false;
+}
+
+// First sector after the index where `count` sectors are free, or 0 if there is none
+uint _storeFindSpace(uint count)
+{
+  uint first = STORE_ADDRESS / FLASH_SECTOR_SIZE + 1;
+  uint last = STORE_ADDRESS / FLASH_SECTOR_SIZE + STORE_SECTORS;
+
+  for (uint sector = first; sector + count <= last; sector++)
+  {
+    bool free = true;
+
+    for (int i = 0; i < STORE_ENTRIES && free; i++)
+    {
+      StoreEntry *entry = &storeIndex.entries[i];
+      uint start = entry->address / FLASH_SECTOR_SIZE;
+
+      free = entry->hash == 0 || sector + count <= start || sector >= start + _storeSectors(entry->length);
+    }
+
+    if (free)
+      return sector;
+  }
+
+  return 0;
+}
+
+// Find an entry and its sectors, dropping programs that do not start a task until they fit.
+// Programs a task runs in place are kept, as erasing them would erase its code
+StoreEntry *MOVE_TO_FLASH _storeMakeRoom(uint length)
+{
+  for (int dropped = 0; dropped <= STORE_ENTRIES; dropped++)
+  {
+    StoreEntry *entry = nullptr;
+    uint sector = _storeFindSpace(_storeSectors(length));
+
+    for (int i = 0; i < STORE_ENTRIES && entry == nullptr; i++)
+    {
+      if (storeIndex.entries[i].hash == 0)
+        entry = &storeIndex.entries[i];
+    }
+
+    if (entry != nullptr && sector != 0)
+    {
+      entry->address = sector * FLASH_SECTOR_SIZE;
+      return entry;
+    }
+
+    for (int i = 0; i < STORE_ENTRIES; i++)
+    {
+      StoreEntry *candidate = &storeIndex.entries[i];
+
+      if (candidate->hash != 0 && !_storeIsAutostart(candidate->hash) && !_storeIsRunning(candidate))
+      {
+        candidate->hash = 0;
+        break;
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+// Keep a program in flash, unless it is there already
+bool MOVE_TO_FLASH store_save(byteref bytes, uint length)
+{
+  uint32 hash = store_hash(bytes, length);
+  uint32 words[64];
+  StoreEntry *entry;
+
+  if (store_has(hash))
+    return true;
+
+  entry = _storeMakeRoom(length);
+
+  if (entry == nullptr)
+    return false;
+
+  for (uint i = 0; i < _storeSectors(length); i++)
+  {
+    os_flash_erase(entry->address / FLASH_SECTOR_SIZE + i);
+  }
+
+  // flash is written in words, from a buffer aligned to them
+  for (uint i = 0; i < length; i += sizeof(words))
+  {
+    uint count = length - i < sizeof(words) ? length - i : sizeof(words);
+
+    os_memcpy(words, bytes + i, count);
+
+    if (!os_flash_write(entry->address + i, words, (count + 3) & ~3u))
+      return false;
+  }
+
+  entry->hash = hash;
+  entry->length = length;
+  return _storeWriteIndex();
+}
+
+// Run a stored program in a task, in place from mapped flash, so it takes no RAM for
+// its bytes. If it does not match its hash, the task keeps the program it had
+bool MOVE_TO_FLASH store_load(int task, uint32 hash)
+{
+  StoreEntry *entry = _storeFind(hash);
+  byteref image;
+
+  if (entry == nullptr || scheduler_task(task) == nullptr)
+    return false;
+
+  image = os_flash_map(entry->address);
+
+  if (store_hash(image, entry->length) != hash)
+    return false;
+
+  return scheduler_loadInPlace(task, image, entry->length);
+}
+
+// Start a stored program in a task after every restart, or nothing with hash 0
+bool MOVE_TO_FLASH store_autostart(int task, uint32 hash)
+{
+  if (scheduler_task(task) == nullptr || (hash != 0 && !store_has(hash)))
+    return false;
+
+  storeIndex.autostart[task] = hash;
+  return _storeWriteIndex();
+}
+
+// Start the programs marked with store_autostart, from setup()
+void MOVE_TO_FLASH store_boot()
+{
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    if (storeIndex.autostart[i] != 0)
+      store_load(i, storeIndex.autostart[i]);
+  }
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifdef WITH_TRACE
+
+// Binary trace: with debug on, each call to _debug keeps its format and values in a
+// record of the ring buffer of the program, and a timer sends the records in frames
+// between the text output. No text is formatted on the chip.
+// A frame is `0x00 kind length(2 bytes LE) payload`. Text output has no 0x00 bytes,
+// so test/trace.cpp can tell them apart and print the text we get without traces.
+#define TRACE_FRAME_FORMAT 'F'
+#define TRACE_FRAME_RECORDS 'R'
+#define TRACE_FRAME_LOST 'L'
+
+// milliseconds between two frames of records, and records in a frame
+#define TRACE_DRAIN_INTERVAL 20
+#define TRACE_DRAIN_RECORDS 16
+#define MAX_TRACE_FRAME (4 + TRACE_DRAIN_RECORDS * sizeof(TraceRecord))
+
+// formats are the string literals given to _debug, the same for every program
+static const char *traceFormats[MAX_TRACE_FORMATS];
+static uint traceFormatCount = 0;
+static byte traceFrame[MAX_TRACE_FRAME];
+
+void trace_drain(void *arg);
+
+byte _traceFormatOf(const char *format)
+{
+  uint i = 0;
+
+  for (; i < traceFormatCount; i++)
+  {
+    if (traceFormats[i] == format)
+      return i;
+  }
+
+  if (traceFormatCount == MAX_TRACE_FORMATS)
+    return MAX_TRACE_FORMATS;
+
+  traceFormats[traceFormatCount] = format;
+  return traceFormatCount++;
+}
+
+void MOVE_TO_FLASH trace_start(Program *p)
+{
+  Trace *trace = &p->trace;
+
+  if (trace->records == nullptr)
+  {
+    trace->records = (TraceRecord *)_allocate(p, TRACE_BUFFER_SIZE * sizeof(TraceRecord));
+    os_timer_setfn(&trace->timer, &trace_drain, p);
+  }
+}
+
+void MOVE_TO_FLASH trace_stop(Program *p)
+{
+  Trace *trace = &p->trace;
+
+  os_timer_disarm(&trace->timer);
+  os_free(trace->records);
+  os_memset(trace, 0, sizeof(Trace));
+}
+
+// When the buffer is full the oldest record makes room, and is counted as lost
+void trace_write(Program *p, const char *format, va_list args)
+{
+  Trace *trace = &p->trace;
+  TraceRecord *record;
+
+  if (trace->records == nullptr)
+    return;
+
+  if (trace->count == TRACE_BUFFER_SIZE)
+  {
+    trace->head = (trace->head + 1) % TRACE_BUFFER_SIZE;
+    trace->count--;
+    trace->lost++;
+  }
+
+  record = &trace->records[(trace->head + trace->count) % TRACE_BUFFER_SIZE];
+  trace->count++;
+
+  record->time = os_time();
+  record->offset = p->instruction ? p->instruction->offset : 0;
+  record->opcode = p->instruction ? p->instruction->opcode : 0;
+  record->format = _traceFormatOf(format);
+  record->argumentCount = 0;
+
+  // the same conversions as Program::printf
+  for (const char *c = format; *c; c++)
+  {
+    if (*c != '%')
+      continue;
+
+    if (!*++c)
+      break;
+
+    if (*c != 'd' && *c != 'x' && *c != 'c' && *c != 's' && *c != 'p')
+      continue;
+
+    if (record->argumentCount == TRACE_ARGUMENTS)
+      break;
+
+    uint32 *argument = &record->arguments[record->argumentCount++];
+
+    switch (*c)
+    {
+    case 's':
+      va_arg(args, char *);
+      *argument = 0;
+      break;
+
+    case 'p':
+      *argument = (uint32)(size_t)va_arg(args, void *);
+      break;
+
+    default:
+      *argument = va_arg(args, int);
+    }
+  }
+
+  if (!trace->draining)
+  {
+    trace->draining = true;
+    os_timer_disarm(&trace->timer);
+    os_timer_arm(&trace->timer, TRACE_DRAIN_INTERVAL, 0);
+  }
+}
+
+// Frames go to the output ring with the text, in the order they happen
+void _traceSend(Program *p, byte kind, uint length)
+{
+  traceFrame[0] = 0;
+  traceFrame[1] = kind;
+  traceFrame[2] = length & 0xff;
+  traceFrame[3] = length >> 8;
+  p->putchars((char *)traceFrame, length + 4);
+}
+
+uint _traceFormatLength(byte format)
+{
+  uint length = os_strlen(traceFormats[format]);
+  return length < MAX_TRACE_FRAME - 5 ? length : MAX_TRACE_FRAME - 5;
+}
+
+// Send the formats of the next records, then the records. A frame is never cut: the
+// records that do not fit in the output ring with their formats wait for the next drain
+void trace_drain(void *arg)
+{
+  Program *p = (Program *)arg;
+  Trace *trace = &p->trace;
+  uint count = trace->count < TRACE_DRAIN_RECORDS ? trace->count : TRACE_DRAIN_RECORDS;
+  uint64 formats = 0;
+  uint size = 4 + (trace->lost ? 4 + sizeof(uint32) : 0);
+  uint room;
+  byteref payload = traceFrame + 4;
+  uint i;
+
+  trace->draining = false;
+
+  if (p->onSend == nullptr || trace->records == nullptr)
+    return;
+
+  p->flush();
+  room = MAX_PRINT_BUFFER - p->printLength;
+
+  for (i = 0; i < count; i++)
+  {
+    byte format = trace->records[(trace->head + i) % TRACE_BUFFER_SIZE].format;
+    bool newFormat = format != MAX_TRACE_FORMATS && !(formats & (1ULL << format));
+    uint length = sizeof(TraceRecord) + (newFormat ? 5 + _traceFormatLength(format) : 0);
+
+    if (size + length > room)
+      break;
+
+    size += length;
+
+    if (newFormat)
+      formats |= 1ULL << format;
+  }
+
+  count = i;
+
+  if (trace->lost && size <= room)
+  {
+    os_memcpy(payload, &trace->lost, sizeof(uint32));
+    _traceSend(p, TRACE_FRAME_LOST, sizeof(uint32));
+    trace->lost = 0;
+  }
+
+  for (i = 0; i < MAX_TRACE_FORMATS; i++)
+  {
+    uint length;
+
+    if (!(formats & (1ULL << i)))
+      continue;
+
+    length = _traceFormatLength(i);
+    payload[0] = i;
+    os_memcpy(payload + 1, traceFormats[i], length);
+    _traceSend(p, TRACE_FRAME_FORMAT, length + 1);
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    os_memcpy(payload + i * sizeof(TraceRecord), &trace->records[(trace->head + i) % TRACE_BUFFER_SIZE],
+              sizeof(TraceRecord));
+  }
+
+  if (count)
+    _traceSend(p, TRACE_FRAME_RECORDS, count * sizeof(TraceRecord));
+
+  p->flush();
+  trace->head = (trace->head + count) % TRACE_BUFFER_SIZE;
+  trace->count -= count;
+
+  if (trace->count)
+  {
+    trace->draining = true;
+    os_timer_arm(&trace->timer, TRACE_DRAIN_INTERVAL, 0);
+  }
+}
+
+#else
+
+void trace_start(Program *p)
+{
+}
+
+void trace_stop(Program *p)
+{
+}
+
+#endif
@@ -2,7 +2,47 @@
 #define MAX_STACK_SIZE 64
 #define MAX_STACK_CURSOR MAX_STACK_SIZE - 1
 #define MAX_PRINT_BUFFER 1024
-#define MAX_PRINT_CURSOR MAX_PRINT_BUFFER - 1
+#define MAX_OPERANDS 3
+
+// instructions run in one tick before the program yields back to the SDK
+#ifndef INSTRUCTION_BUDGET
+#define INSTRUCTION_BUDGET 1000
+#endif
+#define PACKED_PROGRAM_VERSION 2
+
+// Debug output of the VM, by level. Calls above TRACE_LEVEL are not built, with their
+// arguments and format strings. Builds with WITH_DEBUG keep everything, others nothing
+#define TRACE_NONE 0
+#define TRACE_ERRORS 1
+#define TRACE_ALL 2
+
+#ifndef TRACE_LEVEL
+#ifdef WITH_DEBUG
+#define TRACE_LEVEL TRACE_ALL
+#else
+#define TRACE_LEVEL TRACE_NONE
+#endif
+#endif
+
+// WITH_STATS counts how often each opcode runs and how long it takes, with the
+// allocations and output bytes of each program. Without it the counters are not built
+#ifdef WITH_STATS
+#define STATS(...) __VA_ARGS__
+#else
+#define STATS(...)
+#endif
+#define MAX_OPCODES 0x80
+
+// WITH_TRACE writes debug output as binary records to a ring buffer, sent in the background
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE 128
+#endif
+#define TRACE_ARGUMENTS 4
+#define MAX_TRACE_FORMATS 64
+
+// WITH_PROFILER samples the instruction that runs from a timer interrupt
+#define MAX_PROFILE_ENTRIES 128
+#define PROFILE_STACK_DEPTH 4
 
 #define vt_null 0
 #define vt_identifier 1
@@ -13,6 +53,7 @@
 #define vt_signedInteger 6
 #define vt_string 7
 #define vt_blob 8
+#define vt_constant 9
 
 typedef unsigned char byte;
 typedef unsigned char *byteref;
@@ -23,12 +64,18 @@ typedef unsigned long long uint64;
 
 class Buffer;
 
+// Tagged value. Bytes, pins, integers and addresses are stored inline in `number`,
+// only strings and blobs point to memory
 class Value
 {
 protected:
   bool hasValue = false;
   byte type = 0;
-  void *value = nullptr;
+  union
+  {
+    uint32 number;
+    void *value = nullptr;
+  };
 
   void freeValue()
   {
@@ -36,13 +83,25 @@ protected:
     {
       os_free(value);
       value = nullptr;
+      hasValue = false;
     }
   }
 
 public:
-  void update(Value value)
+  // copies never own the memory of the original value
+  void update(Value other)
   {
-    update(value.type, value.value, value.hasValue);
+    freeValue();
+    *this = other;
+    hasValue = false;
+  }
+
+  void update(byte newType, uint32 newNumber)
+  {
+    freeValue();
+    type = newType;
+    value = nullptr;
+    number = newNumber;
   }
 
   void update(byte newType, void *newValue)
@@ -63,24 +122,20 @@ public:
     return type;
   }
 
-  uint32 toInteger()
+  bool isNumber()
   {
-    byteref byte0 = (byteref)value;
-    byteref byte1 = byte0 + 1;
-    byteref byte2 = byte1 + 1;
-    byteref byte3 = byte2 + 1;
-
-    uint32 number = (*byte3 & 0xff) << 24 |
-                    (*byte2 & 0xff) << 16 |
-                    (*byte1 & 0xff) << 8 |
-                    (*byte0 & 0xff);
+    return type == vt_byte || type == vt_pin || type == vt_identifier ||
+           type == vt_integer || type == vt_signedInteger || type == vt_address;
+  }
 
+  uint32 toInteger()
+  {
     return number;
   }
 
   byte toByte()
   {
-    return *((byteref)value);
+    return (byte)number;
   }
 
   uint fromAddress()
@@ -98,16 +153,25 @@ public:
     return (byteref)value;
   }
 
+  // point a string or blob of `length` bytes at `from` to the same bytes at `to`
+  void move(byteref from, uint length, byteref to)
+  {
+    if (!hasValue && (type == vt_string || type == vt_blob) && (byteref)value >= from &&
+        (byteref)value < from + length)
+    {
+      value = to + ((byteref)value - from);
+    }
+  }
+
   bool toBoolean()
   {
     switch (type)
     {
     case vt_byte:
-    case vt_identifier: // TODO unwrap value of identifier
-      return toByte() != 0;
-
+    case vt_identifier:
     case vt_integer:
-      return toInteger() != 0;
+    case vt_signedInteger:
+      return number != 0;
 
     case vt_string:
       return os_strlen((const char *)toString()) != 0;
@@ -123,20 +187,209 @@ public:
   }
 };
 
-typedef void (*send_callback)(char *, int);
+// Operand of a pre-decoded instruction.
+// Bytes, pins, slot ids and integers are decoded once into `number`.
+// Strings and blobs keep a pointer to their data in the program bytes
+typedef struct
+{
+  byte type;
+  union
+  {
+    uint number;
+    byteref data;
+  };
+} Operand;
+
+// Fixed-width record built by program_load for each instruction.
+// `offset` is where the instruction starts in the original bytecode
+typedef struct
+{
+  byte opcode;
+  uint offset;
+  Operand operands[MAX_OPERANDS];
+#ifdef WITH_THREADED_DISPATCH
+  void *handler;
+#endif
+} Instruction;
+
+#ifdef WITH_STATS
+// The time of an instruction runs from its dispatch to the next one, in microseconds
+typedef struct
+{
+  uint executions[MAX_OPCODES];
+  uint time[MAX_OPCODES];
+  uint allocations;
+  uint allocatedBytes;
+  uint outputBytes;
+  byte lastOpcode;
+  uint lastTime;
+} Stats;
+#endif
+
+#ifdef WITH_OPTIMIZER
+// What the optimizer saved on the program that is loaded
+typedef struct
+{
+  uint folded;
+  uint removedInstructions;
+  uint removedBytes;
+  // slots whose reads were replaced by their value, a bit each
+  uint32 propagated[MAX_SLOTS / 32];
+} Optimization;
+#endif
+
+#ifdef WITH_EVAL
+// A string or blob a fragment left in a slot, copied after this header
+typedef struct EvalData
+{
+  struct EvalData *next;
+  uint size;
+} EvalData;
+#endif
+
+#ifdef WITH_PROFILER
+// Samples that landed on one instruction with the same innermost calls.
+// `callers` are the records a call returns to, innermost first
+typedef struct
+{
+  uint position;
+  uint depth;
+  uint callers[PROFILE_STACK_DEPTH];
+  uint count;
+} ProfileEntry;
+
+typedef struct
+{
+  ProfileEntry entries[MAX_PROFILE_ENTRIES];
+  uint samples;
+  uint dropped;
+} Profile;
+#endif
+
+#ifdef WITH_TRACE
+// One call to _debug: the format is sent once per batch, the values of each call
+// are kept as they are and formatted later by test/trace.cpp
+typedef struct
+{
+  uint32 time;
+  uint32 offset;
+  byte opcode;
+  byte format;
+  byte argumentCount;
+  byte reserved;
+  uint32 arguments[TRACE_ARGUMENTS];
+} TraceRecord;
+
+typedef struct
+{
+  TraceRecord *records;
+  uint head;
+  uint count;
+  uint lost;
+  bool draining;
+  Timer timer;
+} Trace;
+#endif
+
+// Text on the heap, for replies and reports longer than an output ring. It grows as it
+// is written, up to MAX_REPORT_SIZE bytes, and what does not fit is left out
+#ifndef MAX_REPORT_SIZE
+#define MAX_REPORT_SIZE 16384
+#endif
+
+typedef struct
+{
+  char *bytes;
+  uint length;
+  uint size;
+} Report;
+
+void report_write(Report *report, const char *text, uint length)
+{
+  uint size = report->size ? report->size : 256;
+  char *bytes;
+
+  while (size < report->length + length && size < MAX_REPORT_SIZE)
+  {
+    size *= 2;
+  }
+
+  size = size < MAX_REPORT_SIZE ? size : MAX_REPORT_SIZE;
+
+  if (size != report->size)
+  {
+    bytes = (char *)os_realloc(report->bytes, size);
+
+    if (bytes == nullptr)
+      return;
+
+    report->bytes = bytes;
+    report->size = size;
+  }
+
+  length = length < report->size - report->length ? length : report->size - report->length;
+  os_memcpy(report->bytes + report->length, text, length);
+  report->length += length;
+}
+
+void report_free(Report *report)
+{
+  os_free(report->bytes);
+  os_memset(report, 0, sizeof(Report));
+}
+
+// Returns false when the transport cannot take the bytes yet, and they are sent again later
+typedef bool (*send_callback)(char *, int);
 typedef void (*halt_callback)();
 
 class Program
 {
 public:
   Timer timer;
+  // uploaded bytes; `bytes` is the code inside them, after the header of a v2 program
+  byteref image = nullptr;
+  uint imageLength = 0;
+  // a program that runs in place has its image in mapped flash, and copies of
+  // its strings and blobs in `data`, where they can be read byte by byte
+  bool imageInFlash = false;
+  byteref data = nullptr;
+  byte version = 1;
   byteref bytes = nullptr;
   uint endOfTheProgram = 0;
+  Operand *pool = nullptr;
+  uint poolSize = 0;
+  uint *functions = nullptr;
+  uint functionCount = 0;
+  Instruction *code = nullptr;
+  uint instructionCount = 0;
+  Instruction *instruction = nullptr;
+  byte operandCursor = 0;
   uint counter = 0;
   uint delayTime = 0;
+  uint instructionBudget = INSTRUCTION_BUDGET;
+  uint preemptions = 0;
+  uint64 instructionsRun = 0;
+  bool preempted = false;
+#ifdef WITH_STATS
+  Stats stats;
+#endif
+#ifdef WITH_OPTIMIZER
+  Optimization optimization;
+#endif
+#ifdef WITH_EVAL
+  // kept while a slot points into them, as copies of a slot do not own its memory
+  EvalData *evalData = nullptr;
+#endif
+#ifdef WITH_PROFILER
+  Profile *profile = nullptr;
+#endif
+#ifdef WITH_TRACE
+  Trace trace;
+#endif
   Value slots[MAX_SLOTS];
   uint interruptHandlers[NUMBER_OF_PINS];
   bool paused = false;
+  bool verified = false;
   bool debug = false;
   send_callback onSend = 0;
   halt_callback onHalt = 0;
@@ -144,18 +397,33 @@ public:
   int callStack[MAX_STACK_SIZE];
   int callStackCursor = 0;
 
+  // Output ring: printLength bytes from printHead wait to be sent, and the first
+  // printSending of them are with the transport. With waitForSent the transport
+  // calls sent() when it is done with them, otherwise they are done once onSend returns
   char printBuffer[MAX_PRINT_BUFFER];
-  int printBufferCursor = 0;
+  uint printHead = 0;
+  uint printLength = 0;
+  uint printSending = 0;
+  uint droppedBytes = 0;
+  bool waitForSent = false;
+  // while it is set, what the program prints goes there instead of the ring
+  Report *report = nullptr;
 
   void reset()
   {
     counter = 0;
     paused = false;
 
+    for (int i = 0; i < MAX_SLOTS; i++)
+    {
+      slots[i].update(vt_null, nullptr);
+    }
+
     os_memset(&interruptHandlers, 0, NUMBER_OF_PINS * sizeof(uint));
     os_memset(&callStack, 0, MAX_STACK_SIZE * sizeof(int));
-    os_memset(&printBuffer, 0, MAX_PRINT_BUFFER);
-    printBufferCursor = 0;
+    // bytes with the transport stay until it is done with them
+    printLength = printSending;
+    droppedBytes = 0;
   }
 
   int callStackPush()
@@ -167,7 +435,7 @@ public:
       return -1;
     }
 
-    if (callStack[callStackCursor - 1] == counter)
+    if (callStackCursor > 0 && callStack[callStackCursor - 1] == (int)counter)
     {
       return 0;
     }
@@ -197,43 +465,91 @@ public:
     for (; i <= MAX_STACK_CURSOR; i++)
     {
       if (callStack[i])
-        os_printf("  %d\n", callStack[i]);
+        os_printf("  %d\n", code[callStack[i]].offset);
     }
   }
 
+  // Hand the bytes up to the end of the ring to the transport, one send at a time
   void flush()
   {
-    if (printBufferCursor == 0)
+    if (printLength == 0 || printSending || onSend == nullptr)
     {
       return;
     }
 
-    if (onSend)
+    uint length = printHead + printLength > MAX_PRINT_BUFFER ? MAX_PRINT_BUFFER - printHead : printLength;
+
+    printSending = length;
+
+    if (!onSend(printBuffer + printHead, length))
     {
-      onSend(printBuffer, printBufferCursor);
+      printSending = 0;
+      return;
     }
 
-    printBufferCursor = 0;
-    os_memset(&printBuffer, 0, MAX_PRINT_BUFFER);
+    if (!waitForSent)
+    {
+      sent();
+    }
   }
 
-  void putchar(char c)
+  // The transport is done with the last send: free its bytes and send the next ones
+  void sent()
   {
-    if (printBufferCursor >= MAX_PRINT_CURSOR)
+    if (printSending == 0)
     {
-      flush();
+      return;
     }
 
-    printBuffer[printBufferCursor++] = c;
+    STATS(stats.outputBytes += printSending);
+    printHead = (printHead + printSending) % MAX_PRINT_BUFFER;
+    printLength -= printSending;
+    printSending = 0;
+    flush();
   }
 
+  void putchar(char c)
+  {
+    putchars(&c, 1);
+  }
+
+  // Copy into the free space after the bytes that wait. When the ring is full and the
+  // transport is busy, what does not fit is dropped and counted
   void putchars(const char *c, int len)
   {
-    int i = 0;
+    if (report != nullptr)
+    {
+      report_write(report, c, len);
+      return;
+    }
+
+    while (len > 0)
+    {
+      if (printLength == MAX_PRINT_BUFFER)
+      {
+        flush();
+      }
+
+      if (printLength == MAX_PRINT_BUFFER)
+      {
+        droppedBytes += len;
+        return;
+      }
+
+      uint tail = (printHead + printLength) % MAX_PRINT_BUFFER;
+      uint room = (tail < printHead ? printHead : MAX_PRINT_BUFFER) - tail;
+      uint length = (uint)len < room ? (uint)len : room;
 
-    for (; i < len; i++)
+      os_memcpy(printBuffer + tail, c, length);
+      printLength += length;
+      c += length;
+      len -= length;
+    }
+
+    // half of the ring is ready: send it while the other half fills
+    if (printLength >= MAX_PRINT_BUFFER / 2)
     {
-      putchar(c[i]);
+      flush();
     }
   }
 
@@ -399,18 +715,18 @@ public:
     case vt_byte:
     case vt_pin:
     case vt_identifier:
-      value.update(type, (void *)cursor);
+      value.update(type, (uint32)*cursor);
       cursor++;
       break;
 
     case vt_null:
-      value.update(type, 0);
+      value.update(type, nullptr);
       cursor++;
       break;
 
     case vt_integer:
     case vt_address:
-      value.update(type, (void *)cursor);
+      value.update(type, (uint32)(cursor[3] << 24 | cursor[2] << 16 | cursor[1] << 8 | cursor[0]));
       cursor += 4;
       break;
 
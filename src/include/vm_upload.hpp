@@ -0,0 +1,263 @@
+// Uploads: a program that comes in more than one TCP segment is written into a buffer
+// of its full length as it arrives, and replaces the program of its task only once the
+// last byte is in. Until then the task keeps running the program it had
+#ifndef MAX_UPLOAD_SIZE
+#define MAX_UPLOAD_SIZE 16384
+#endif
+
+// A compressed upload starts with 0x00 'L' 'Z' and the varint length of the program.
+// LZSS tokens follow, in groups of 8 after a byte of flags, lowest bit first:
+// 0 is a literal byte, 1 a match of 2 bytes, with 12 bits of distance - 1 and
+// 4 bits of length - 3. Matches copy from the program written so far, so there is
+// no window besides the program buffer. test/pack.cpp -z writes them
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH 18
+#define LZ_WINDOW 4096
+#define MAX_UPLOAD_HEADER 8
+
+typedef struct
+{
+  int task;
+  bool active;
+  // a patch for the program of the task, see program_patch, or a fragment to run
+  // in it, see upload_eval, instead of a program
+  bool patch;
+  bool eval;
+  bool failed;
+  // bytes of the body, those still to come, and the first ones until the format is known
+  uint bodyLength;
+  uint remaining;
+  byte header[MAX_UPLOAD_HEADER];
+  uint headerLength;
+  // the program, `received` of its `length` bytes are written
+  byteref bytes;
+  uint length;
+  uint received;
+  // state of a compressed upload: flags of the tokens left in the group, and the
+  // first byte of a match that was cut between two segments
+  bool compressed;
+  byte flags;
+  byte tokens;
+  bool hasMatchByte;
+  byte matchByte;
+} Upload;
+
+void MOVE_TO_FLASH upload_cancel(Upload *upload)
+{
+  os_free(upload->bytes);
+  os_memset(upload, 0, sizeof(Upload));
+}
+
+// Expect a body of `length` bytes for a task. Drops an upload that did not finish
+bool MOVE_TO_FLASH upload_start(Upload *upload, int task, uint length)
+{
+  upload_cancel(upload);
+
+  if (length == 0 || length > MAX_UPLOAD_SIZE || scheduler_task(task) == nullptr)
+  {
+    return false;
+  }
+
+  upload->task = task;
+  upload->active = true;
+  upload->bodyLength = length;
+  upload->remaining = length;
+  return true;
+}
+
+bool upload_active(Upload *upload)
+{
+  return upload->active;
+}
+
+// Nothing more to write: the whole body came, or it can not be a program
+bool upload_done(Upload *upload)
+{
+  return upload->active && (upload->remaining == 0 || upload->failed);
+}
+
+void _uploadAllocate(Upload *upload, uint length)
+{
+  // one more byte for the \0 of program_decode, in whole words for _byteAt
+  upload->bytes = length && length <= MAX_UPLOAD_SIZE ? (byteref)os_zalloc(_wordSize(length)) : nullptr;
+  upload->length = length;
+  upload->failed = upload->bytes == nullptr;
+}
+
+// Read the first bytes until the format is known, then make room for the program.
+// Uncompressed bodies are the program, and keep their first bytes
+void _uploadHeader(Upload *upload, byte b, bool last)
+{
+  byteref header = upload->header;
+  uint length;
+
+  header[upload->headerLength++] = b;
+
+  if (header[0] == 0 && (upload->headerLength < 2 || header[1] == 'L') &&
+      (upload->headerLength < 3 || header[2] == 'Z') && !last)
+  {
+    if (upload->headerLength < 4)
+      return;
+
+    if (_decodeVarint(header, 3, upload->headerLength, &length) == -1)
+    {
+      upload->failed = upload->headerLength == MAX_UPLOAD_HEADER;
+      return;
+    }
+
+    upload->compressed = true;
+    _uploadAllocate(upload, length);
+    return;
+  }
+
+  _uploadAllocate(upload, upload->bodyLength);
+
+  if (upload->bytes != nullptr)
+  {
+    os_memcpy(upload->bytes, header, upload->headerLength);
+    upload->received = upload->headerLength;
+  }
+}
+
+// Decompress one byte of the body into the program
+void _uploadInflate(Upload *upload, byte b)
+{
+  if (upload->tokens == 0)
+  {
+    upload->flags = b;
+    upload->tokens = 8;
+    return;
+  }
+
+  if (!(upload->flags & 1))
+  {
+    if (upload->received == upload->length)
+    {
+      upload->failed = true;
+      return;
+    }
+
+    upload->bytes[upload->received++] = b;
+  }
+  else if (!upload->hasMatchByte)
+  {
+    upload->matchByte = b;
+    upload->hasMatchByte = true;
+    return;
+  }
+  else
+  {
+    uint distance = (upload->matchByte << 4 | b >> 4) + 1;
+    uint count = (b & 0x0f) + LZ_MIN_MATCH;
+
+    upload->hasMatchByte = false;
+
+    if (distance > upload->received || count > upload->length - upload->received)
+    {
+      upload->failed = true;
+      return;
+    }
+
+    // byte by byte: a match can overlap the bytes it writes
+    for (; count; count--, upload->received++)
+    {
+      upload->bytes[upload->received] = upload->bytes[upload->received - distance];
+    }
+  }
+
+  upload->flags >>= 1;
+  upload->tokens--;
+}
+
+// Append the next bytes of the body, and return how many were taken.
+// Bytes past the length given to upload_start are not part of the program
+uint upload_write(Upload *upload, byteref data, uint length)
+{
+  uint count = length < upload->remaining ? length : upload->remaining;
+  uint i = 0;
+
+  if (!upload->active || upload->failed)
+  {
+    return 0;
+  }
+
+  upload->remaining -= count;
+
+  for (; i < count && upload->bytes == nullptr && !upload->failed; i++)
+  {
+    _uploadHeader(upload, data[i], upload->remaining == 0 && i == count - 1);
+  }
+
+  if (upload->compressed)
+  {
+    for (; i < count && !upload->failed; i++)
+    {
+      _uploadInflate(upload, data[i]);
+    }
+  }
+  else if (upload->bytes != nullptr)
+  {
+    os_memcpy(upload->bytes + upload->received, data + i, count - i);
+    upload->received += count - i;
+  }
+
+  return count;
+}
+
+// Swap the uploaded program in. The task keeps the buffer as the image of the program.
+// A patch is applied to the program the task runs, and its buffer is dropped
+bool MOVE_TO_FLASH upload_finish(Upload *upload)
+{
+  bool loaded = false;
+
+  if (!upload_done(upload))
+  {
+    return false;
+  }
+
+#ifdef WITH_PATCH
+  if (!upload->failed && upload->received == upload->length && upload->patch)
+  {
+    const char *error = scheduler_patch(upload->task, upload->bytes, upload->length);
+
+    if (error != nullptr)
+      os_printf("[!] Invalid patch: %s\n", error);
+
+    upload_cancel(upload);
+    return error == nullptr;
+  }
+#endif
+
+  if (!upload->failed && upload->received == upload->length && !upload->patch)
+  {
+    loaded = scheduler_loadImage(upload->task, upload->bytes, upload->length);
+    upload->bytes = nullptr;
+  }
+
+  upload_cancel(upload);
+  return loaded;
+}
+
+#ifdef WITH_EVAL
+// Run an uploaded fragment inside the program of its task, with the output it prints
+// in `output`, of MAX_PRINT_BUFFER bytes. Returns an error, or nullptr if it ran
+const char *MOVE_TO_FLASH upload_eval(Upload *upload, char *output, uint *outputLength)
+{
+  const char *error = "incomplete fragment";
+
+  *outputLength = 0;
+
+  if (!upload_done(upload))
+  {
+    return error;
+  }
+
+  if (!upload->failed && upload->received == upload->length)
+  {
+    error = scheduler_eval(upload->task, upload->bytes, upload->length, output, outputLength);
+  }
+
+  upload_cancel(upload);
+  return error;
+}
+#endif
@@ -1,5 +1,9 @@
 
-#define WITH_DEBUG
+#define WITH_THREADED_DISPATCH
+#define WITH_OPTIMIZER
+#define WITH_STORE
+#define WITH_PATCH
+#define WITH_EVAL
 #define SERIAL_SPEED 115200
 #define __CHIP_ESP8266__
 
@@ -13,19 +17,40 @@
 #define WIFI_PASSWORD "HomeBots"
 #endif
 
-#ifdef WITH_DEBUG
+// Release firmware has no debug output. Build with WITH_DEBUG, or a TRACE_LEVEL, to keep it
+#if TRACE_LEVEL >= TRACE_ALL
 #define TRACE(...) os_printf(__VA_ARGS__);
 #else
 #define TRACE(...)
 #endif
 
-static Program program;
 static os_timer_t wifiTimer;
 static struct espconn *conn;
 static const char *httpOK = "HTTP/1.1 200 OK\r\n\r\n";
 static const char *httpNotOK = "HTTP/1.1 400 Bad payload\r\n\r\n";
+static const char *httpNotStored = "HTTP/1.1 404 Not stored\r\n\r\n";
 static const char separator[4] = {0x0d, 0x0a, 0x0d, 0x0a};
 
+// The connection takes one send at a time: the reply or task output in flight, if any,
+// is freed by the sent callback. Replies wait in `replies` and go before task output
+#define REPLY_SEGMENT 1460
+
+static bool sending = false;
+static Program *sendingTask = nullptr;
+static Report replies;
+static uint replySent = 0;
+static uint replySending = 0;
+
+// the program of a POST, or the patch of a PATCH, that is still coming in,
+// and if the program should run after a restart
+static Upload upload;
+static bool autostart = false;
+
+#ifdef WITH_EVAL
+// what an eval printed
+static char evalOutput[MAX_PRINT_BUFFER];
+#endif
+
 void checkAgain()
 {
   os_timer_disarm(&wifiTimer);
@@ -60,24 +85,276 @@ void checkConnection(void *arg)
   checkAgain();
 }
 
+// Send the next segment of the replies, if the connection is free
+void sendReply()
+{
+  uint length = replies.length - replySent;
+
+  if (sending || length == 0)
+  {
+    return;
+  }
+
+  length = length < REPLY_SEGMENT ? length : REPLY_SEGMENT;
+
+  if (espconn_send(conn, (uint8 *)replies.bytes + replySent, length) == 0)
+  {
+    sending = true;
+    replySending = length;
+  }
+}
+
+void reply(const char *text, uint length)
+{
+  report_write(&replies, text, length);
+  sendReply();
+}
+
+void reply(const char *text)
+{
+  reply(text, strlen(text));
+}
+
+// Task from the path of a request: "POST / HTTP/1.1" is task 0, "POST /2 HTTP/1.1" is task 2.
+// Returns -1 for a path that is not a task
+int taskOf(char *data, unsigned short length)
+{
+  int i = 0;
+  int id = 0;
+
+  while (i < length && data[i] != ' ')
+  {
+    i++;
+  }
+
+  if (i + 1 >= length || data[i + 1] != '/')
+  {
+    return -1;
+  }
+
+  for (i += 2; i < length && data[i] >= '0' && data[i] <= '9'; i++)
+  {
+    id = id * 10 + data[i] - '0';
+
+    if (id >= MAX_TASKS)
+    {
+      return -1;
+    }
+  }
+
+  return i < length && data[i] == ' ' ? id : -1;
+}
+
+// Where the value of a header starts, or -1 without it. `name` is lowercase, with its ':'
+int headerOf(char *data, int length, const char *name)
+{
+  int i = 0;
+  int j;
+
+  for (; i < length; i++)
+  {
+    if (data[i] != '\n')
+      continue;
+
+    for (j = 0; name[j] && i + 1 + j < length && (data[i + 1 + j] | 0x20) == name[j]; j++)
+      ;
+
+    if (name[j] == 0)
+      break;
+  }
+
+  if (i == length)
+  {
+    return -1;
+  }
+
+  for (i += 1 + j; i < length && data[i] == ' '; i++)
+    ;
+
+  return i;
+}
+
+// Number in a header, in decimal or hex, or -1 without the header
+long long numberOf(char *data, int length, const char *name, int base)
+{
+  int i = headerOf(data, length, name);
+  long long value = 0;
+
+  if (i == -1)
+  {
+    return -1;
+  }
+
+  for (; i < length; i++)
+  {
+    char c = data[i] | 0x20;
+    int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : base;
+
+    if (digit >= base)
+      break;
+
+    value = value * base + digit;
+  }
+
+  return value;
+}
+
+#ifdef WITH_EVAL
+// Run a fragment in a task and answer with its output
+void onEval()
+{
+  uint outputLength;
+  const char *error = upload_eval(&upload, evalOutput, &outputLength);
+
+  if (error != nullptr)
+  {
+    reply(httpNotOK);
+    reply(error);
+    reply("\n");
+    return;
+  }
+
+  reply(httpOK);
+  reply(evalOutput, outputLength);
+}
+#endif
+
+// Swap the program in, or patch it, once the body of its request is complete
+void onUploaded()
+{
+  int task = upload.task;
+  uint length = upload.length;
+#ifdef WITH_STORE
+  bool patch = upload.patch;
+#endif
+
+#ifdef WITH_EVAL
+  if (upload.eval)
+  {
+    onEval();
+    return;
+  }
+#endif
+
+  if (upload_finish(&upload))
+  {
+    TRACE("Running %d bytes in task %d\n", length, task);
+    reply(httpOK);
+
+#ifdef WITH_STORE
+    Program *program = scheduler_task(task);
+
+    // a patched program is not the one a client can ask for by its hash
+    if (patch)
+      return;
+
+    if (store_save(program->image, program->imageLength) && autostart)
+      store_autostart(task, store_hash(program->image, program->imageLength));
+#endif
+    return;
+  }
+
+  reply(httpNotOK);
+  espconn_disconnect(conn);
+}
+
 void onReceive(void *arg, char *data, unsigned short length)
 {
   int i = 0;
+  int task;
+  int contentLength;
+  bool patch = false;
+
+  // the next segment of a program
+  if (upload_active(&upload))
+  {
+    upload_write(&upload, (byteref)data, length);
+
+    if (upload_done(&upload))
+      onUploaded();
+
+    return;
+  }
+
+  task = taskOf(data, length);
+
+#ifdef WITH_STATS
+  if (strncmp(data, "GET /stats ", 11) == 0)
+  {
+    reply(httpOK);
+    scheduler_printStats(&replies);
+    sendReply();
+    return;
+  }
+#endif
+
+#ifdef WITH_PROFILER
+  if (strncmp(data, "GET /profile ", 13) == 0)
+  {
+    reply(httpOK);
+    profiler_printTasks(&replies);
+    sendReply();
+    return;
+  }
+#endif
+
+  if (task == -1)
+  {
+    reply(httpNotOK);
+    espconn_disconnect(conn);
+    return;
+  }
 
   if (strncmp(data, "GET", 3) == 0)
   {
-    espconn_send(conn, (uint8 *)httpOK, strlen(httpOK));
-    program.flush();
+    reply(httpOK);
+    scheduler_task(task)->flush();
     return;
   }
 
-  if (strncmp(data, "POST", 4) != 0)
+  if (strncmp(data, "DELETE", 6) == 0)
   {
-    espconn_send(conn, (uint8 *)httpNotOK, strlen(httpNotOK));
+    scheduler_stop(task);
+#ifdef WITH_STORE
+    store_autostart(task, 0);
+#endif
+    reply(httpOK);
+    return;
+  }
+
+#ifdef WITH_STORE
+  // run a stored program by its hash, so a client can skip the upload
+  if (strncmp(data, "PUT", 3) == 0)
+  {
+    long long hash = numberOf(data, length, "program-hash:", 16);
+
+    if (hash <= 0 || !store_load(task, (uint32)hash))
+    {
+      reply(httpNotStored);
+      return;
+    }
+
+    if (headerOf(data, length, "autostart:") != -1)
+      store_autostart(task, (uint32)hash);
+
+    reply(httpOK);
+    return;
+  }
+#endif
+
+#ifdef WITH_PATCH
+  // a PATCH replaces a function of the program that runs, keeping its state
+  patch = strncmp(data, "PATCH", 5) == 0;
+#endif
+
+  if (!patch && strncmp(data, "POST", 4) != 0)
+  {
+    reply(httpNotOK);
     espconn_disconnect(conn);
+    return;
   }
 
-  // skip headers
+  // skip headers, which must come in the first segment
   while (i < length)
   {
     if (data[i] == 0x0d && strncmp(data + i, separator, 4) == 0)
@@ -89,24 +366,79 @@ void onReceive(void *arg, char *data, unsigned short length)
     i++;
   }
 
-  if (i < length)
+  // without Content-Length the body is what came with the headers
+  contentLength = numberOf(data, i, "content-length:", 10);
+  autostart = headerOf(data, i, "autostart:") != -1;
+
+  if (contentLength == -1)
+  {
+    contentLength = length - i;
+  }
+
+  if (!upload_start(&upload, task, contentLength))
   {
-    TRACE("Running %d bytes\n", length - i);
-    espconn_send(conn, (uint8 *)httpOK, strlen(httpOK));
-    program_load(&program, (unsigned char *)data + i, length - i);
+    reply(httpNotOK);
+    espconn_disconnect(conn);
     return;
   }
 
-  espconn_send(conn, (uint8 *)httpNotOK, strlen(httpNotOK));
-  espconn_disconnect(conn);
+  upload.patch = patch;
+#ifdef WITH_EVAL
+  // with an Eval header, the body runs once in the program of the task, which goes on after it
+  upload.eval = !patch && headerOf(data, i, "eval:") != -1;
+#endif
+  upload_write(&upload, (byteref)data + i, length - i);
+
+  if (upload_done(&upload))
+    onUploaded();
+}
+
+// The bytes stay in the output ring of the task until onSent
+bool onSend(char *data, int length)
+{
+  if (sending || replies.length || espconn_send(conn, (uint8 *)data, length) != 0)
+  {
+    return false;
+  }
+
+  sending = true;
+
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    Program *task = scheduler_task(i);
+
+    if (data >= task->printBuffer && data < task->printBuffer + MAX_PRINT_BUFFER)
+    {
+      sendingTask = task;
+    }
+  }
+
+  return true;
 }
 
-void onSend(char *data, int length)
+void onSent(void *arg)
 {
-  if (conn->state == ESPCONN_WRITE)
+  Program *task = sendingTask;
+
+  sending = false;
+  sendingTask = nullptr;
+  replySent += replySending;
+  replySending = 0;
+
+  if (replySent == replies.length)
   {
-    espconn_send(conn, (uint8 *)data, length);
+    report_free(&replies);
+    replySent = 0;
   }
+
+  if (task != nullptr)
+  {
+    task->sent();
+  }
+
+  sendReply();
+  scheduler_flush();
+  checkAgain();
 }
 
 void onHalt()
@@ -121,6 +453,12 @@ void onHalt()
 void onDisconnect(void *arg)
 {
   TRACE("Disconnected\n");
+  // nothing in flight will be acknowledged now, and replies have no one to go to
+  report_free(&replies);
+  replySent = 0;
+  replySending = 0;
+  onSent(arg);
+  upload_cancel(&upload);
   espconn_accept(conn);
   checkAgain();
 }
@@ -155,11 +493,24 @@ void setup()
   espconn_regist_connectcb(conn, &onConnect);
   espconn_regist_recvcb(conn, &onReceive);
   espconn_regist_disconcb(conn, &onDisconnect);
-  espconn_regist_sentcb(conn, (espconn_sent_callback)&checkAgain);
+  espconn_regist_sentcb(conn, &onSent);
   espconn_accept(conn);
 
-  program.onSend = &onSend;
-  program.onHalt = &onHalt;
+  scheduler_setup(&onSend, &onHalt);
+
+  for (int i = 0; i < MAX_TASKS; i++)
+  {
+    scheduler_task(i)->waitForSent = true;
+  }
+
+#ifdef WITH_STORE
+  store_open();
+  store_boot();
+#endif
+
+#ifdef WITH_PROFILER
+  profiler_start(PROFILE_INTERVAL);
+#endif
 
   os_timer_setfn(&wifiTimer, &checkConnection, conn);
   checkAgain();
@@ -0,0 +1,312 @@
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include "emit.hpp"
+#include <stdio.h>
+#include <time.h>
+
+// Measures the cost of each family of instructions, and the time to load and run
+// each program given in the arguments, and prints the results as JSON:
+//
+//   bench [examples/basics/hello.bin ...] > results.json
+//
+// Every family runs in a loop of its instructions followed by `yield` and `jumpto`.
+// The cost of an empty loop is measured first and taken out of each family.
+
+#define ROUNDS 200000
+#define PROGRAM_RUNS 200
+
+typedef void (*builder)();
+
+typedef struct
+{
+  const char *name;
+  builder build;
+} Family;
+
+// a target is always the last operand, so the next instruction starts after it
+void emitNextTarget()
+{
+  emitTarget(length + 5);
+}
+
+uint64 now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void discardOutput(const char *text, int length) {}
+bool discardSend(char *text, int length)
+{
+  return true;
+}
+
+void buildEmpty() {}
+
+// add, sub, mul, mod, and, xor, lt, equal on integers
+void buildBinary()
+{
+  byte operations[] = {op_add, op_sub, op_mul, op_mod, op_and, op_xor, op_lt, op_equal};
+
+  for (int round = 0; round < 2; round++)
+  {
+    for (uint i = 0; i < sizeof(operations); i++)
+    {
+      emit(operations[i]);
+      emitSlot(0);
+      emitInteger(7 + i);
+      emitInteger(3);
+    }
+  }
+}
+
+// taken and not taken, plain and fused, all landing on the next instruction
+void buildJumps()
+{
+  for (int round = 0; round < 4; round++)
+  {
+    emit(op_goto);
+    emitNextTarget();
+
+    emit(op_gotoif);
+    emitByte(0);
+    emitNextTarget();
+
+    emit(op_gotoif);
+    emitByte(1);
+    emitNextTarget();
+
+    emit(op_jumplt);
+    emitInteger(1);
+    emitInteger(2);
+    emitNextTarget();
+  }
+}
+
+void buildDeclare()
+{
+  for (int round = 0; round < 4; round++)
+  {
+    emit(op_declare);
+    emitSlot(0);
+    emitInteger(round);
+
+    emit(op_assign);
+    emitSlot(1);
+    emitSlot(0);
+
+    emit(op_assign);
+    emitSlot(2);
+    emitString("text");
+
+    emit(op_addto);
+    emitSlot(0);
+    emitInteger(1);
+  }
+}
+
+void buildPrint()
+{
+  for (int round = 0; round < 8; round++)
+  {
+    emit(op_print);
+    emitString("Hello");
+
+    emit(op_print);
+    emitInteger(1234);
+  }
+}
+
+void buildIo()
+{
+  for (int round = 0; round < 8; round++)
+  {
+    emit(op_iowrite);
+    emitByte(0);
+    emitByte(round & 1);
+
+    emit(op_ioread);
+    emitSlot(0);
+    emitByte(0);
+  }
+}
+
+void buildI2c()
+{
+  for (int round = 0; round < 4; round++)
+  {
+    emit(op_i2cstart);
+
+    emit(op_i2cwrite);
+    emitByte(0x40);
+
+    emit(op_i2cread);
+    emitSlot(0);
+
+    emit(op_i2cstop);
+  }
+}
+
+static Family families[] = {
+    {"binary", &buildBinary},   {"jumps", &buildJumps}, {"declare", &buildDeclare},
+    {"print", &buildPrint},     {"io", &buildIo},       {"i2c", &buildI2c},
+};
+
+// Run a family in a loop and return the time of each round in ns
+double runFamily(Family *family, uint64 *instructions, uint64 *allocations)
+{
+  Program *program = new Program();
+
+  length = 0;
+  family->build();
+  emit(op_yield);
+  emit(op_jumpto);
+  emitTarget(0);
+
+  program->onSend = &discardSend;
+  program_decode(program, bytes, length);
+
+  if (!program->verified)
+  {
+    printf("\"%s\" is not a valid program\n", family->name);
+    exit(1);
+  }
+
+  uint64 heap = mockAllocations;
+  uint64 start = now();
+
+  for (int i = 0; i < ROUNDS; i++)
+  {
+    program->delayTime = 0;
+    vm_run(program);
+  }
+
+  uint64 elapsed = now() - start;
+  *allocations = mockAllocations - heap;
+  *instructions = program->instructionsRun;
+
+  program_unload(program);
+  delete program;
+
+  return (double)elapsed / ROUNDS;
+}
+
+void benchmarkFamilies()
+{
+  Family empty = {"empty", &buildEmpty};
+  uint64 loopInstructions;
+  uint64 allocations;
+  double loop = runFamily(&empty, &loopInstructions, &allocations);
+  int count = sizeof(families) / sizeof(Family);
+
+  printf("  \"loop\": {\"instructions\": %llu, \"ns_per_round\": %.2f},\n", loopInstructions, loop);
+  printf("  \"families\": [\n");
+
+  for (int i = 0; i < count; i++)
+  {
+    uint64 instructions;
+    double round = runFamily(&families[i], &instructions, &allocations);
+    uint64 measured = instructions - loopInstructions;
+
+    printf("    {\"name\": \"%s\", \"instructions\": %llu, \"ns_per_instruction\": %.2f, "
+           "\"allocations_per_10k\": %.1f}%s\n",
+           families[i].name, measured, (round - loop) * ROUNDS / measured, allocations * 10000.0 / measured,
+           i < count - 1 ? "," : "");
+  }
+
+  printf("  ],\n");
+}
+
+bool readFile(const char *fileName, byteref *buffer, long *size)
+{
+  FILE *file = fopen(fileName, "r");
+
+  if (file == NULL)
+    return false;
+
+  fseek(file, 0L, SEEK_END);
+  *size = ftell(file);
+  rewind(file);
+  *buffer = (byteref)malloc(*size);
+  *size = fread(*buffer, 1, *size, file);
+  fclose(file);
+  return true;
+}
+
+// load and run a program to the end, on the virtual clock
+void benchmarkProgram(const char *fileName, bool last)
+{
+  byteref buffer;
+  long size;
+  uint64 instructions = 0;
+  uint64 elapsed = 0;
+  const char *error = nullptr;
+
+  if (!readFile(fileName, &buffer, &size))
+  {
+    printf("    {\"path\": \"%s\", \"error\": \"file not found\"}%s\n", fileName, last ? "" : ",");
+    return;
+  }
+
+  for (int i = 0; i < PROGRAM_RUNS && !error; i++)
+  {
+    Program *program = new Program();
+    uint64 start = now();
+
+    mock_reset();
+    program->onSend = &discardSend;
+
+    if (program_load(program, buffer, size))
+    {
+      mock_run(100000, 60000);
+      elapsed += now() - start;
+      instructions = program->instructionsRun;
+    }
+    else
+    {
+      error = "invalid program";
+    }
+
+    program_unload(program);
+    delete program;
+  }
+
+  free(buffer);
+
+  if (error)
+  {
+    printf("    {\"path\": \"%s\", \"error\": \"%s\"}%s\n", fileName, error, last ? "" : ",");
+    return;
+  }
+
+  printf("    {\"path\": \"%s\", \"bytes\": %ld, \"instructions\": %llu, \"us_per_run\": %.2f}%s\n", fileName, size,
+         instructions, elapsed / 1000.0 / PROGRAM_RUNS, last ? "" : ",");
+}
+
+int main(int argc, char **argv)
+{
+  mockOutput = &discardOutput;
+
+  printf("{\n");
+#ifdef WITH_THREADED_DISPATCH
+  printf("  \"engine\": \"threaded\",\n");
+#else
+  printf("  \"engine\": \"switch\",\n");
+#endif
+  printf("  \"trace_level\": %d,\n", TRACE_LEVEL);
+
+  benchmarkFamilies();
+
+  printf("  \"programs\": [\n");
+
+  for (int i = 1; i < argc; i++)
+  {
+    benchmarkProgram(argv[i], i == argc - 1);
+  }
+
+  printf("  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,75 @@
+// Helpers for tests that build their programs byte by byte, in `bytes`, and collect
+// what the programs print in `output`. Include after vm.hpp
+
+#ifndef MAX_EMIT_PROGRAM
+#define MAX_EMIT_PROGRAM 512
+#endif
+
+#ifndef MAX_EMIT_OUTPUT
+#define MAX_EMIT_OUTPUT 4096
+#endif
+
+static unsigned char bytes[MAX_EMIT_PROGRAM];
+static int length = 0;
+static char output[MAX_EMIT_OUTPUT];
+static int outputLength = 0;
+
+void emit(unsigned char b)
+{
+  bytes[length++] = b;
+}
+
+void emitSlot(unsigned char slot)
+{
+  emit(vt_identifier);
+  emit(slot);
+}
+
+void emitByte(unsigned char value)
+{
+  emit(vt_byte);
+  emit(value);
+}
+
+// 4 bytes, little endian, without a type
+void emitWord(uint value)
+{
+  emit(value & 0xff);
+  emit((value >> 8) & 0xff);
+  emit((value >> 16) & 0xff);
+  emit((value >> 24) & 0xff);
+}
+
+void emitInteger(uint value)
+{
+  emit(vt_integer);
+  emitWord(value);
+}
+
+void emitString(const char *text)
+{
+  emit(vt_string);
+
+  for (; *text; text++)
+    emit(*text);
+
+  emit(0);
+}
+
+void emitTarget(uint offset)
+{
+  emitInteger(offset);
+  bytes[length - 5] = vt_address;
+}
+
+// A send callback that keeps what the program prints in `output`, as long as it fits
+bool collect(char *text, int count)
+{
+  if (outputLength + count < MAX_EMIT_OUTPUT)
+  {
+    os_memcpy(output + outputLength, text, count);
+    outputLength += count;
+  }
+
+  return true;
+}
@@ -2,7 +2,8 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
-#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
 
 #define NUMBER_OF_PINS 4
 #define MOVE_TO_FLASH
@@ -12,24 +13,52 @@ typedef unsigned char uint8;
 typedef unsigned int uint32;
 typedef unsigned long long uint64;
 
+// Where os_printf and the mock print to: stdout, unless a thread sets its own writer.
+// All the state of the mock is per thread, so programs can run in parallel
+typedef void (*mockWriter)(const char *text, int length);
+
+thread_local mockWriter mockOutput = nullptr;
+thread_local int mockPins[NUMBER_OF_PINS] = {1, 1, 1, 1};
+
+void mock_printf(const char *format, ...)
+{
+  char text[512];
+  va_list args;
+
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+
+  if (length > (int)sizeof(text) - 1)
+    length = sizeof(text) - 1;
+
+  if (mockOutput != nullptr)
+  {
+    mockOutput(text, length);
+    return;
+  }
+
+  fwrite(text, 1, length, stdout);
+}
+
 int os_io_read(uint8 pin)
 {
-  return 1;
+  return mockPins[pin];
 }
 
 void os_io_write(uint8 pin, bool value)
 {
-  printf("IO value %d = %d\n", pin, value);
+  mock_printf("IO value %d = %d\n", pin, value);
 }
 
 void os_io_type(uint8 pin, uint8 value)
 {
-  printf("IO type %d = %d\n", pin, value);
+  mock_printf("IO type %d = %d\n", pin, value);
 }
 
 void os_io_mode(uint8 pin, uint8 mode)
 {
-  printf("IO mode %d = %d\n", pin, mode);
+  mock_printf("IO mode %d = %d\n", pin, mode);
 }
 
 void noop(...) {}
@@ -44,10 +73,6 @@ uint8 bytenoop(...)
   return 1;
 }
 
-#define os_io_interrupt noop
-#define os_io_enableInterrupts noop
-#define os_io_disableInterrupts noop
-
 #define os_i2c_setup noop
 #define os_i2c_start noop
 #define os_i2c_stop noop
@@ -62,20 +87,37 @@ uint8 bytenoop(...)
 #define os_mem_write noop
 #define os_memcpy memcpy
 
-#define os_free ::free
-#define os_realloc realloc
+// heap usage counters, to measure allocations made by the VM
+thread_local uint64 mockAllocations = 0;
+thread_local uint64 mockFrees = 0;
 
 void *os_zalloc(int size)
 {
   void *p = malloc(size);
   memset(p, 0, size);
+  mockAllocations++;
   return p;
 }
 
-#define os_printf ::printf
+void *os_realloc(void *p, int size)
+{
+  mockAllocations++;
+  return realloc(p, size);
+}
+
+void os_free(void *p)
+{
+  if (p != nullptr)
+  {
+    mockFrees++;
+  }
+
+  ::free(p);
+}
+
+#define os_printf mock_printf
 #define os_sprintf sprintf
 #define os_strlen strlen
-#define os_time intnoop
 #define os_restart noop
 #define os_freeHeapSize intnoop
 #define os_memset memset
@@ -84,49 +126,419 @@ typedef void timerCallback(void *arg);
 
 typedef struct
 {
-  int delay;
   timerCallback *fn;
   void *arg;
+  // changes on every arm and disarm, so events of an old arm are skipped
+  uint32 generation;
 } Timer;
 
+// ========= Virtual clock =========
+// Timers and synthetic interrupts are events in a min-heap ordered by virtual time.
+// mock_loop() runs them in order and moves the clock forward, so delays take no real time
+// and no callback runs inside another one
+
+typedef struct
+{
+  uint64 time;
+  uint64 sequence;
+  Timer *timer;
+  uint32 generation;
+  uint8 pin;
+  int level;
+} MockEvent;
+
+typedef void (*interruptCallback)(void *arg, uint8 pin);
+
+typedef struct
+{
+  interruptCallback callback;
+  void *arg;
+  uint8 mode;
+} MockInterrupt;
+
+// microseconds since the start of the simulation
+thread_local uint64 mockTime = 0;
+thread_local uint64 mockTimerCalls = 0;
+
+thread_local MockEvent *mockEvents = nullptr;
+thread_local uint32 mockEventCount = 0;
+thread_local uint32 mockEventCapacity = 0;
+thread_local uint64 mockSequence = 0;
+
+thread_local MockInterrupt mockInterrupts[NUMBER_OF_PINS];
+thread_local bool mockInterruptsEnabled = true;
+// events at the same time run in the order they were scheduled
+bool _mockBefore(MockEvent *a, MockEvent *b)
+{
+  return a->time < b->time || (a->time == b->time && a->sequence < b->sequence);
+}
+
+void _mockSwap(uint32 a, uint32 b)
+{
+  MockEvent event = mockEvents[a];
+  mockEvents[a] = mockEvents[b];
+  mockEvents[b] = event;
+}
+
+void _mockPush(MockEvent event)
+{
+  uint32 i = mockEventCount++;
+
+  if (mockEventCount > mockEventCapacity)
+  {
+    mockEventCapacity = mockEventCapacity ? mockEventCapacity * 2 : 16;
+    mockEvents = (MockEvent *)realloc(mockEvents, mockEventCapacity * sizeof(MockEvent));
+  }
+
+  event.sequence = mockSequence++;
+  mockEvents[i] = event;
+
+  while (i > 0 && _mockBefore(&mockEvents[i], &mockEvents[(i - 1) / 2]))
+  {
+    _mockSwap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+MockEvent _mockPop()
+{
+  MockEvent first = mockEvents[0];
+  uint32 i = 0;
+
+  mockEvents[0] = mockEvents[--mockEventCount];
+
+  while (true)
+  {
+    uint32 left = 2 * i + 1;
+    uint32 right = left + 1;
+    uint32 smallest = i;
+
+    if (left < mockEventCount && _mockBefore(&mockEvents[left], &mockEvents[smallest]))
+      smallest = left;
+
+    if (right < mockEventCount && _mockBefore(&mockEvents[right], &mockEvents[smallest]))
+      smallest = right;
+
+    if (smallest == i)
+      break;
+
+    _mockSwap(i, smallest);
+    i = smallest;
+  }
+
+  return first;
+}
+
+uint32 os_time()
+{
+  return (uint32)mockTime;
+}
+
 void os_timer_setfn(Timer *timer, timerCallback *fn, void *arg)
 {
   timer->fn = fn;
   timer->arg = arg;
+  timer->generation++;
+}
+
+void os_timer_disarm(Timer *timer)
+{
+  timer->generation++;
 }
 
-void os_timer_arm(Timer *timer, unsigned int delay, int zero)
+void os_timer_arm(Timer *timer, unsigned int delay, int repeat)
 {
-  usleep((unsigned long)(delay * 1000));
-  timer->fn(timer->arg);
+  MockEvent event = {};
+
+  timer->generation++;
+  event.time = mockTime + (uint64)delay * 1000;
+  event.timer = timer;
+  event.generation = timer->generation;
+  _mockPush(event);
 }
 
-void os_timer_disarm(Timer *timer)
+// Change the level of a pin at `time` milliseconds, calling its interrupt handler
+// if the change matches the interrupt mode. A level of -1 toggles the pin
+void mock_interrupt(uint64 time, uint8 pin, int level)
+{
+  MockEvent event = {};
+
+  event.time = time * 1000;
+  event.pin = pin;
+  event.level = level;
+  _mockPush(event);
+}
+
+void _mockTriggerInterrupt(MockEvent *event)
+{
+  uint8 pin = event->pin;
+  int before = mockPins[pin];
+  int after = event->level == -1 ? !before : event->level;
+  MockInterrupt *interrupt = &mockInterrupts[pin];
+  bool triggered = false;
+
+  mockPins[pin] = after;
+  mock_printf("IO interrupt %d = %d\n", pin, after);
+
+  switch (interrupt->mode)
+  {
+  case 1:
+    triggered = !before && after;
+    break;
+  case 2:
+    triggered = before && !after;
+    break;
+  case 3:
+    triggered = before != after;
+    break;
+  case 4:
+    triggered = !after;
+    break;
+  case 5:
+    triggered = after;
+    break;
+  }
+
+  if (triggered && mockInterruptsEnabled && interrupt->callback != nullptr)
+  {
+    interrupt->callback(interrupt->arg, pin);
+  }
+}
+
+// MOCK_INTERRUPTS="1000:0,2500:1:0" changes pin 0 at 1s (toggle) and sets pin 1 to 0 at 2.5s
+void _mockScheduleInterrupts(const char *list)
+{
+  while (list != nullptr && *list)
+  {
+    unsigned long long time = 0;
+    unsigned int pin = 0;
+    int level = -1;
+
+    if (sscanf(list, "%llu:%u:%d", &time, &pin, &level) >= 2 && pin < NUMBER_OF_PINS)
+    {
+      mock_interrupt(time, pin, level);
+    }
+
+    list = strchr(list, ',');
+    list = list ? list + 1 : nullptr;
+  }
+}
+
+// Start a new simulation on this thread: time 0, no events, pins high and no interrupts
+void mock_reset()
+{
+  mockTime = 0;
+  mockTimerCalls = 0;
+  mockEventCount = 0;
+  mockSequence = 0;
+  mockInterruptsEnabled = true;
+
+  for (int i = 0; i < NUMBER_OF_PINS; i++)
+  {
+    mockPins[i] = 1;
+    mockInterrupts[i].callback = nullptr;
+  }
+}
+
+// Free the events of this thread, once it runs no more simulations
+void mock_free()
 {
+  free(mockEvents);
+  mockEvents = nullptr;
+  mockEventCount = 0;
+  mockEventCapacity = 0;
+}
+
+// Run timers and interrupts in order of virtual time until nothing is left to run,
+// `maxTicks` timer calls were made or the clock passes `maxTime` milliseconds. Zero means no limit
+void mock_run(uint64 maxTicks, uint64 maxTime)
+{
+  while (mockEventCount)
+  {
+    MockEvent event = _mockPop();
+
+    if (maxTime && event.time > maxTime * 1000)
+    {
+      mockTime = maxTime * 1000;
+      break;
+    }
+
+    if (event.time > mockTime)
+      mockTime = event.time;
+
+    if (event.timer == nullptr)
+    {
+      _mockTriggerInterrupt(&event);
+      continue;
+    }
+
+    if (event.generation != event.timer->generation)
+      continue;
+
+    if (maxTicks && ++mockTimerCalls > maxTicks)
+      break;
+
+    event.timer->generation++;
+    event.timer->fn(event.timer->arg);
+  }
+}
+
+// mock_run with limits from the environment:
+// MOCK_TICKS=n stops after n timer calls, MOCK_TIME=ms stops when the clock gets there
+void mock_loop()
+{
+  const char *ticks = getenv("MOCK_TICKS");
+  const char *until = getenv("MOCK_TIME");
+
+  _mockScheduleInterrupts(getenv("MOCK_INTERRUPTS"));
+  mock_run(ticks ? atoll(ticks) : 0, until ? atoll(until) : 0);
+  fflush(stdout);
+}
+
+void os_io_interrupt(uint8 pin, void *callback, void *arg, uint8 mode)
+{
+  mockInterrupts[pin].callback = (interruptCallback)callback;
+  mockInterrupts[pin].arg = arg;
+  mockInterrupts[pin].mode = mode;
+}
+
+void os_io_enableInterrupts()
+{
+  mockInterruptsEnabled = true;
+}
+
+void os_io_disableInterrupts()
+{
+  mockInterruptsEnabled = false;
 }
 
 void os_sleep(uint64 time)
 {
-  printf("sleep %d\n", (int)time);
-  usleep(time);
+  mock_printf("sleep %d\n", (int)time);
+  mockTime += time;
+}
+
+// The virtual clock does not move while instructions run, so the profiler samples
+// on the CPU time of the process instead, from a signal like the timer interrupt of the chip
+typedef void (*profilerCallback)();
+profilerCallback mockProfiler = nullptr;
+
+void _mockProfilerSignal(int signal)
+{
+  if (mockProfiler != nullptr)
+    mockProfiler();
+}
+
+void _mockProfilerTimer(uint32 interval)
+{
+  struct itimerval timer = {};
+
+  timer.it_interval.tv_sec = interval / 1000000;
+  timer.it_interval.tv_usec = interval % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+void os_profiler_arm(profilerCallback sample, uint32 interval)
+{
+  mockProfiler = sample;
+  signal(SIGPROF, &_mockProfilerSignal);
+  _mockProfilerTimer(interval);
+}
+
+void os_profiler_disarm()
+{
+  _mockProfilerTimer(0);
+  mockProfiler = nullptr;
+}
+
+// Flash is a file, STORE or store.flash, that keeps what is written between runs.
+// Bytes that were never written read as 0xff, like erased flash
+#define FLASH_SECTOR_SIZE 4096
+
+FILE *_mockFlash()
+{
+  static FILE *flash = nullptr;
+  const char *fileName = getenv("STORE") ? getenv("STORE") : "store.flash";
+
+  if (flash == nullptr)
+    flash = fopen(fileName, "r+b");
+
+  if (flash == nullptr)
+    flash = fopen(fileName, "w+b");
+
+  return flash;
+}
+
+bool os_flash_read(uint32 address, void *data, uint32 length)
+{
+  FILE *flash = _mockFlash();
+  size_t count = 0;
+
+  if (flash == nullptr)
+    return false;
+
+  memset(data, 0xff, length);
+
+  if (fseek(flash, address, SEEK_SET) == 0)
+    count = fread(data, 1, length, flash);
+
+  if (count < length)
+    memset((uint8 *)data + count, 0xff, length - count);
+
+  return true;
+}
+
+bool os_flash_write(uint32 address, const void *data, uint32 length)
+{
+  FILE *flash = _mockFlash();
+
+  return flash != nullptr && fseek(flash, address, SEEK_SET) == 0 && fwrite(data, 1, length, flash) == length &&
+         fflush(flash) == 0;
+}
+
+bool os_flash_erase(uint32 sector)
+{
+  uint8 erased[FLASH_SECTOR_SIZE];
+
+  memset(erased, 0xff, FLASH_SECTOR_SIZE);
+  return os_flash_write(sector * FLASH_SECTOR_SIZE, erased, FLASH_SECTOR_SIZE);
+}
+
+// A copy of the first megabyte of flash, read again on every call, stands for the mapping of the chip
+#define FLASH_MAP_SIZE (1024 * 1024)
+
+uint8 *os_flash_map(uint32 address)
+{
+  static uint8 *mapped = (uint8 *)malloc(FLASH_MAP_SIZE);
+
+  os_flash_read(0, mapped, FLASH_MAP_SIZE);
+  return mapped + address;
+}
+
+// Bytes are read in aligned words, like the chip reads mapped flash
+uint8 os_readByte(const void *address)
+{
+  uint32 word = *(const uint32 *)((size_t)address & ~(size_t)3);
+  return word >> (((size_t)address & 3) * 8);
 }
 
 void os_io_allOutput()
 {
-  printf("All pins to output\n");
+  mock_printf("All pins to output\n");
 }
 
 void os_wifi_ap()
 {
-  printf("stub: wifi AP mode\n");
+  mock_printf("stub: wifi AP mode\n");
 }
 
 void os_wifi_connect(const char *ssid, const char *password)
 {
-  printf("stub: wifi connect %s, %s\n", ssid, password);
+  mock_printf("stub: wifi connect %s, %s\n", ssid, password);
 }
 
 void os_wifi_disconnect()
 {
-  printf("stub: wifi disconnect\n");
+  mock_printf("stub: wifi disconnect\n");
 }
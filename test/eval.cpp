@@ -0,0 +1,257 @@
+#define WITH_OPTIMIZER
+#define WITH_EVAL
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include "emit.hpp"
+#include <stdio.h>
+
+// Runs fragments of code inside a running program and checks that they see and change
+// its slots, that their output comes back apart from the output of the program,
+// and that the program goes on where it was:
+//
+//   eval
+//
+// The program counts in a function it calls in a loop, and prints slot 4 after the count.
+// A fragment prints the count and sets it to 100, calling from the index the program
+// called from. Slot 4 is declared once, so a fragment that sets it is refused.
+
+static char evalOutput[MAX_PRINT_BUFFER + 1];
+static int failures = 0;
+
+// Upload the bytes in `bytes` after `start` as a fragment, in 3 byte segments,
+// and compare its output or its error
+void eval(int start, const char *expected)
+{
+  Upload upload = {};
+  int fragmentLength = length - start;
+  uint evalLength;
+  const char *error;
+
+  upload_start(&upload, 0, fragmentLength);
+  upload.eval = true;
+
+  for (int i = 0; i < fragmentLength; i += 3)
+  {
+    upload_write(&upload, bytes + start + i, fragmentLength - i < 3 ? fragmentLength - i : 3);
+  }
+
+  error = upload_eval(&upload, evalOutput, &evalLength);
+  evalOutput[evalLength] = 0;
+
+  if (error != nullptr)
+    strcpy(evalOutput, error);
+
+  printf("eval: %s\n", evalOutput);
+
+  if (strcmp(evalOutput, expected) != 0)
+  {
+    printf("Expected \"%s\"\n", expected);
+    failures++;
+  }
+
+  length = start;
+}
+
+// The fragments come while the program runs, like requests to the firmware
+void onEvalTimer(void *arg)
+{
+  int end = *(int *)arg;
+  int fragment;
+  int call;
+  int function;
+  int next;
+
+  // print the count through a call of its own, at the index of the call the program
+  // is in, so that both return to the same index, then jump over a print
+  length = end;
+  fragment = length;
+  emit(op_print);
+  emitString("count is ");
+
+  call = length;
+  emit(op_jumpto);
+  emitTarget(0);
+
+  emit(op_goto);
+  emitTarget(length - fragment + 5 + 10);
+
+  emit(op_print);
+  emitString("skipped");
+
+  emit(op_assign);
+  emitSlot(0);
+  emitInteger(100);
+
+  emit(op_assign);
+  emitSlot(3);
+  emitString("kept");
+
+  emit(op_return);
+
+  function = length;
+  emit(op_print);
+  emitSlot(0);
+
+  emit(op_print);
+  emitString("\n");
+
+  emit(op_return);
+  next = length;
+
+  length = call + 1;
+  emitTarget(function - fragment);
+  length = next;
+
+  eval(end, "count is 10\n");
+
+  // a string of an earlier fragment, which is gone
+  emit(op_print);
+  emitSlot(3);
+  eval(end, "kept");
+
+  // a copy of that string outlives the slot it was copied from, in this fragment and after it
+  emit(op_assign);
+  emitSlot(5);
+  emitSlot(3);
+
+  emit(op_assign);
+  emitSlot(3);
+  emitInteger(5);
+
+  emit(op_print);
+  emitSlot(5);
+  eval(end, "kept");
+
+  emit(op_print);
+  emitSlot(5);
+  eval(end, "kept");
+
+  emit(op_goto);
+  emitTarget(0);
+  eval(end, "eval used its instruction budget");
+
+  emit(op_assign);
+  emitSlot(4);
+  emitInteger(2);
+  eval(end, "the fragment writes a slot the optimizer made a constant");
+
+  emit(op_iointerrupt);
+  emit(vt_byte);
+  emit(0);
+  emit(vt_byte);
+  emit(1);
+  emitTarget(0);
+  eval(end, "interrupt handlers are not kept after an eval");
+}
+
+// The program counts from 1, and from 101 after the fragment set the count to 100,
+// with slot 4 at 1 all along
+bool check()
+{
+  int expected = 1;
+  int count;
+  int value;
+  int read;
+  char *line = output;
+
+  output[outputLength] = 0;
+
+  while (sscanf(line, "count %d %d\n%n", &count, &value, &read) == 2)
+  {
+    if (count != expected && !(expected == 11 && count == 101))
+      return false;
+
+    if (value != 1)
+      return false;
+
+    expected = count + 1;
+    line += read;
+  }
+
+  return *line == 0 && expected > 101;
+}
+
+int main(int argc, char **argv)
+{
+  Program *program = scheduler_task(0);
+  Timer evalTimer;
+  int loop;
+  int call;
+  int function;
+  int end;
+
+  scheduler_setup(&collect, nullptr);
+
+  emit(op_declare);
+  emitSlot(0);
+  emitInteger(0);
+
+  emit(op_declare);
+  emitSlot(4);
+  emitInteger(1);
+
+  // the function comes after the loop, and the call is pointed at it below
+  loop = length;
+  call = length;
+  emit(op_jumpto);
+  emitTarget(0);
+
+  emit(op_goto);
+  emitTarget(loop);
+
+  function = length;
+  emit(op_addto);
+  emitSlot(0);
+  emitInteger(1);
+
+  emit(op_print);
+  emitString("count ");
+
+  emit(op_print);
+  emitSlot(0);
+
+  emit(op_print);
+  emitString(" ");
+
+  emit(op_print);
+  emitSlot(4);
+
+  emit(op_print);
+  emitString("\n");
+
+  emit(op_delay);
+  emitInteger(10);
+
+  emit(op_return);
+  end = length;
+
+  length = call + 1;
+  emitTarget(function);
+  length = end;
+
+  if (!scheduler_load(0, bytes, length))
+  {
+    printf("The program is not valid\n");
+    return 1;
+  }
+
+  os_timer_setfn(&evalTimer, &onEvalTimer, &end);
+  os_timer_arm(&evalTimer, 95, 0);
+  mock_run(0, 195);
+  program->flush();
+  fwrite(output, 1, outputLength, stdout);
+
+  if (!check())
+  {
+    printf("The program did not go on from the count the fragment set\n");
+    return 1;
+  }
+
+  if (failures)
+    return 1;
+
+  printf("Fragments ran inside the program, which went on from the count they set\n");
+  return 0;
+}
@@ -0,0 +1,314 @@
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include <dirent.h>
+#include <stdio.h>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs many programs in parallel, each one in its own Program on the virtual clock
+// of its thread, and reports pass or fail, instructions run and simulated time.
+//
+//   fleet [-j threads] [-t ms] [-n ticks] directory|manifest
+//
+// A directory runs every .bin in it. A manifest has one program per line, optionally
+// followed by a file with the output it should print. In a directory, `name.out`
+// next to `name.bin` is the expected output. Without one, a program passes if it halts.
+
+typedef struct
+{
+  std::string path;
+  std::string expected;
+} Job;
+
+typedef struct
+{
+  bool passed;
+  const char *reason;
+  uint64 instructions;
+  uint64 time;
+  std::string output;
+} Result;
+
+// each worker takes jobs from the back of its own queue,
+// and steals from the front of the others when it runs out
+typedef struct
+{
+  std::mutex lock;
+  std::deque<int> jobs;
+} Worker;
+
+static std::vector<Job> jobs;
+static std::vector<Result> results;
+static Worker *workers;
+static int workerCount = 0;
+static uint64 maxTime = 60000;
+static uint64 maxTicks = 100000;
+
+thread_local std::string *capture = nullptr;
+
+void captureOutput(const char *text, int length)
+{
+  capture->append(text, length);
+}
+
+bool onSend(char *text, int length)
+{
+  capture->append(text, length);
+  return true;
+}
+
+bool readFile(const std::string &path, std::string *content)
+{
+  FILE *file = fopen(path.c_str(), "r");
+  char buffer[4096];
+  size_t length;
+
+  if (file == NULL)
+    return false;
+
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    content->append(buffer, length);
+  }
+
+  fclose(file);
+  return true;
+}
+
+void runJob(int index)
+{
+  Job *job = &jobs[index];
+  Result *result = &results[index];
+  Program *program = new Program();
+  std::string bytes;
+  std::string expected;
+
+  capture = &result->output;
+  mockOutput = &captureOutput;
+  mock_reset();
+  program->onSend = &onSend;
+
+  if (!readFile(job->path, &bytes))
+  {
+    result->reason = "file not found";
+  }
+  else if (!program_load(program, (byteref)bytes.data(), bytes.size()))
+  {
+    result->reason = "invalid program";
+  }
+  else
+  {
+    mock_run(maxTicks, maxTime);
+    program->flush();
+    result->instructions = program->instructionsRun;
+    result->time = mockTime / 1000;
+
+    if (!job->expected.empty())
+    {
+      result->passed = readFile(job->expected, &expected) && expected == result->output;
+      result->reason = result->passed ? "output matches" : "output differs";
+    }
+    else
+    {
+      result->passed = program->paused;
+      result->reason = result->passed ? "halted" : "did not halt";
+    }
+  }
+
+  program_unload(program);
+  delete program;
+  mockOutput = nullptr;
+  capture = nullptr;
+}
+
+bool takeJob(int self, int *job)
+{
+  for (int i = 0; i < workerCount; i++)
+  {
+    Worker *worker = &workers[(self + i) % workerCount];
+    std::lock_guard<std::mutex> guard(worker->lock);
+
+    if (worker->jobs.empty())
+      continue;
+
+    if (i == 0)
+    {
+      *job = worker->jobs.back();
+      worker->jobs.pop_back();
+    }
+    else
+    {
+      *job = worker->jobs.front();
+      worker->jobs.pop_front();
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+void work(int self)
+{
+  int job;
+
+  while (takeJob(self, &job))
+  {
+    runJob(job);
+  }
+
+  mock_free();
+}
+
+bool endsWith(const std::string &text, const char *end)
+{
+  size_t length = strlen(end);
+  return text.size() >= length && text.compare(text.size() - length, length, end) == 0;
+}
+
+bool exists(const std::string &path)
+{
+  FILE *file = fopen(path.c_str(), "r");
+
+  if (file == NULL)
+    return false;
+
+  fclose(file);
+  return true;
+}
+
+bool readDirectory(const std::string &path)
+{
+  DIR *directory = opendir(path.c_str());
+  struct dirent *entry;
+
+  if (directory == NULL)
+    return false;
+
+  while ((entry = readdir(directory)) != NULL)
+  {
+    Job job;
+    job.path = path + "/" + entry->d_name;
+
+    if (!endsWith(job.path, ".bin"))
+      continue;
+
+    std::string expected = job.path.substr(0, job.path.size() - 4) + ".out";
+
+    if (exists(expected))
+      job.expected = expected;
+
+    jobs.push_back(job);
+  }
+
+  closedir(directory);
+  std::sort(jobs.begin(), jobs.end(), [](const Job &a, const Job &b) { return a.path < b.path; });
+  return true;
+}
+
+// paths in a manifest are relative to the manifest
+bool readManifest(const std::string &path)
+{
+  std::string content;
+  std::string base = path.find('/') == std::string::npos ? "" : path.substr(0, path.rfind('/') + 1);
+  char program[1024];
+  char expected[1024];
+
+  if (!readFile(path, &content))
+    return false;
+
+  for (size_t start = 0; start < content.size();)
+  {
+    size_t end = content.find('\n', start);
+    std::string line = content.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    start = end == std::string::npos ? content.size() : end + 1;
+
+    int fields = sscanf(line.c_str(), "%1023s %1023s", program, expected);
+
+    if (fields < 1 || program[0] == '#')
+      continue;
+
+    Job job;
+    job.path = program[0] == '/' ? program : base + program;
+
+    if (fields == 2)
+      job.expected = expected[0] == '/' ? expected : base + expected;
+
+    jobs.push_back(job);
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  int threads = std::thread::hardware_concurrency();
+  int failed = 0;
+  int i = 1;
+
+  for (; i < argc - 1 && argv[i][0] == '-'; i += 2)
+  {
+    if (!strcmp(argv[i], "-j"))
+      threads = atoi(argv[i + 1]);
+    else if (!strcmp(argv[i], "-t"))
+      maxTime = atoll(argv[i + 1]);
+    else if (!strcmp(argv[i], "-n"))
+      maxTicks = atoll(argv[i + 1]);
+  }
+
+  if (i >= argc)
+  {
+    printf("Usage:\n  fleet [-j threads] [-t ms] [-n ticks] directory|manifest\n");
+    return -1;
+  }
+
+  if (!readDirectory(argv[i]) && !readManifest(argv[i]))
+  {
+    perror("Error reading programs");
+    return -1;
+  }
+
+  workerCount = std::max(1, std::min(threads, (int)jobs.size()));
+  workers = new Worker[workerCount];
+  results.resize(jobs.size());
+
+  for (i = 0; i < (int)jobs.size(); i++)
+  {
+    results[i].passed = false;
+    results[i].instructions = 0;
+    results[i].time = 0;
+    workers[i % workerCount].jobs.push_back(i);
+  }
+
+  std::vector<std::thread> pool;
+
+  for (i = 0; i < workerCount; i++)
+  {
+    pool.push_back(std::thread(work, i));
+  }
+
+  for (i = 0; i < workerCount; i++)
+  {
+    pool[i].join();
+  }
+
+  for (i = 0; i < (int)jobs.size(); i++)
+  {
+    Result *result = &results[i];
+    failed += !result->passed;
+    printf("%s %s: %s, %llu instructions, %llu ms\n", result->passed ? "PASS" : "FAIL", jobs[i].path.c_str(),
+           result->reason, result->instructions, result->time);
+  }
+
+  printf("%d programs, %d passed, %d failed, %d threads\n", (int)jobs.size(), (int)jobs.size() - failed, failed,
+         workerCount);
+
+  delete[] workers;
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+#define SERIAL_SPEED 115200
+#define MAX_EMIT_PROGRAM 1024
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include "emit.hpp"
+#include <stdio.h>
+
+// Runs every fused operation, with its jump taken and not taken, and compares what
+// the program prints:
+//
+//   fused
+//
+// Each compare and jump runs with 7 > 5, 5 < 7 and 7 == 7, and prints "t" when it jumps
+// and "n" when it goes on. A jump must not leave anything on the call stack.
+
+static const char *expected = "012\n7\ntnn tnt ntn ntt nnt ttn \n";
+
+// compare `a` and `b`, both slot 0 when they are 0, and print if the jump was taken
+void emitBranch(byte opcode, uint a, uint b)
+{
+  emit(opcode);
+
+  if (a)
+    emitInteger(a);
+  else
+    emitSlot(0);
+
+  if (b)
+    emitInteger(b);
+  else
+    emitSlot(0);
+
+  // over a print of 4 bytes and a goto of 6
+  emitTarget(length + 5 + 10);
+
+  emit(op_print);
+  emitString("n");
+
+  emit(op_goto);
+  emitTarget(length + 5 + 4);
+
+  emit(op_print);
+  emitString("t");
+}
+
+int main(int argc, char **argv)
+{
+  Program *program = scheduler_task(0);
+  uint loop;
+
+  scheduler_setup(&collect, nullptr);
+
+  emit(op_declare);
+  emitSlot(0);
+  emitInteger(0);
+
+  // print 0 to 2, and leave 3 in slot 0
+  loop = length;
+  emit(op_print);
+  emitSlot(0);
+
+  emit(op_incjumplt);
+  emitSlot(0);
+  emitInteger(3);
+  emitTarget(loop);
+
+  emit(op_print);
+  emitString("\n");
+
+  emit(op_addto);
+  emitSlot(0);
+  emitInteger(4);
+
+  emit(op_print);
+  emitSlot(0);
+
+  emit(op_print);
+  emitString("\n");
+
+  for (byte opcode = op_jumpgt; opcode <= op_jumpnotequal; opcode++)
+  {
+    emitBranch(opcode, 0, 5);
+    emitBranch(opcode, 5, 0);
+    emitBranch(opcode, 0, 7);
+
+    emit(op_print);
+    emitString(" ");
+  }
+
+  emit(op_print);
+  emitString("\n");
+
+  emit(op_halt);
+
+  if (!scheduler_load(0, bytes, length))
+  {
+    printf("The program is not valid\n");
+    return 1;
+  }
+
+  mock_run(0, 1000);
+  program->flush();
+  output[outputLength] = 0;
+  fwrite(output, 1, outputLength, stdout);
+
+  if (strcmp(output, expected) != 0)
+  {
+    printf("Expected:\n%s", expected);
+    return 1;
+  }
+
+  if (program->callStackCursor != 0)
+  {
+    printf("Fused jumps left %d entries on the call stack\n", program->callStackCursor);
+    return 1;
+  }
+
+  printf("Fused operations jumped and added as expected\n");
+  return 0;
+}
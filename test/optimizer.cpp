@@ -0,0 +1,110 @@
+#define WITH_OPTIMIZER
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include "emit.hpp"
+#include <stdio.h>
+
+// Loads a program the optimizer can shorten, and checks what is left of it, what it
+// prints and what the optimizer reports:
+//
+//   optimizer
+//
+// Slot 0 is declared once in the entry and the addition that reads it folds into an
+// assignment. A jump on a constant false condition and a noop are removed, and a goto
+// to a goto is threaded to the end of the chain, which removes the second one.
+
+static const char *expected = "5\n";
+
+int main(int argc, char **argv)
+{
+  Program *program = scheduler_task(0);
+  uint skip;
+  uint chain;
+  uint end;
+
+  scheduler_setup(&collect, nullptr);
+
+  emit(op_declare);
+  emitSlot(0);
+  emitInteger(2);
+
+  // add $1, $0, 3: 10 bytes, folded into assign $1, 5
+  emit(op_add);
+  emitSlot(1);
+  emitSlot(0);
+  emitInteger(3);
+
+  emit(op_print);
+  emitSlot(1);
+
+  // gotoif 0, over the noop: 11 bytes
+  emit(op_gotoif);
+  emitInteger(0);
+  emitTarget(length + 5 + 1);
+
+  emit(op_noop);
+
+  // goto to the goto after the print: 6 bytes, pointed at it below
+  skip = length;
+  emit(op_goto);
+  emitTarget(0);
+
+  emit(op_print);
+  emitString("skipped");
+
+  // a goto to the next instruction
+  chain = length;
+  emit(op_goto);
+  emitTarget(length + 5);
+
+  emit(op_print);
+  emitString("\n");
+
+  emit(op_halt);
+  end = length;
+
+  length = skip + 1;
+  emitTarget(chain);
+  length = end;
+
+  if (!scheduler_load(0, bytes, length))
+  {
+    printf("The program is not valid\n");
+    return 1;
+  }
+
+  mock_run(0, 1000);
+  program->flush();
+  output[outputLength] = 0;
+  fwrite(output, 1, outputLength, stdout);
+
+  if (strcmp(output, expected) != 0)
+  {
+    printf("Expected:\n%s", expected);
+    return 1;
+  }
+
+  Optimization *optimization = &program->optimization;
+
+  printf("%d instructions, %d constants folded, %d instructions and %d bytes removed\n", program->instructionCount,
+         optimization->folded, optimization->removedInstructions, optimization->removedBytes);
+
+  // 10 instructions, less the gotoif, the noop and the goto the first one was threaded past
+  if (program->instructionCount != 7 || optimization->removedInstructions != 3)
+  {
+    printf("Expected 7 instructions, 3 removed\n");
+    return 1;
+  }
+
+  // the read of $0 and the addition, then 2 + 11 + 1 + 6 bytes
+  if (optimization->folded != 2 || optimization->removedBytes != 20)
+  {
+    printf("Expected 2 constants folded and 20 bytes removed\n");
+    return 1;
+  }
+
+  printf("The optimized program prints the same\n");
+  return 0;
+}
@@ -0,0 +1,481 @@
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include <stdio.h>
+
+// Converts a v1 program into the v2 container:
+//   0x00 'E' 'S' 0x02
+//   varint count, constants
+//   varint count, varint function offsets
+//   varint length, code
+// Repeated strings and large integers move to the constant pool,
+// integers and jump targets become varints.
+// With -z the packed program is compressed for uploads, see vm_upload.hpp
+
+#define MAX_PACKED_SIZE 65536
+
+static Program source;
+static Program packed;
+static byte output[MAX_PACKED_SIZE];
+static uint outputLength = 0;
+
+static byte compressed[MAX_PACKED_SIZE + MAX_PACKED_SIZE / 8 + MAX_UPLOAD_HEADER];
+static uint compressedLength = 0;
+
+static Operand constants[MAX_SLOTS];
+static uint constantUses[MAX_SLOTS];
+static uint constantCount = 0;
+static int poolIndex[MAX_SLOTS];
+static uint poolSize = 0;
+
+void emit(byte b)
+{
+  if (outputLength < MAX_PACKED_SIZE)
+    output[outputLength] = b;
+
+  outputLength++;
+}
+
+uint varintLength(uint value)
+{
+  uint length = 1;
+
+  for (; value >= 0x80; value >>= 7)
+    length++;
+
+  return length;
+}
+
+void emitVarint(uint value)
+{
+  for (; value >= 0x80; value >>= 7)
+    emit((value & 0x7f) | 0x80);
+
+  emit(value);
+}
+
+bool isInteger(Operand *operand)
+{
+  return operand->type == vt_integer || operand->type == vt_signedInteger || operand->type == vt_address;
+}
+
+bool sameConstant(Operand *a, Operand *b)
+{
+  if (a->type != b->type)
+    return false;
+
+  if (a->type == vt_string)
+    return strcmp((const char *)a->data, (const char *)b->data) == 0;
+
+  return a->number == b->number;
+}
+
+int findConstant(Operand *operand)
+{
+  for (uint i = 0; i < constantCount; i++)
+  {
+    if (sameConstant(&constants[i], operand))
+      return i;
+  }
+
+  return -1;
+}
+
+// bytes of a value written inline, without its type
+uint inlineLength(Operand *operand)
+{
+  if (operand->type == vt_string)
+    return os_strlen((const char *)operand->data) + 1;
+
+  return varintLength(operand->number);
+}
+
+void collectConstants()
+{
+  for (uint i = 0; i < source.instructionCount; i++)
+  {
+    Instruction *instruction = &source.code[i];
+    const char *signature = _signatureOf(instruction->opcode);
+
+    for (int j = 0; signature[j]; j++)
+    {
+      Operand *operand = &instruction->operands[j];
+
+      if (signature[j] == 'T' || signature[j] == 'L' || (operand->type != vt_string && !isInteger(operand)))
+        continue;
+
+      int index = findConstant(operand);
+
+      if (index == -1 && constantCount < MAX_SLOTS)
+      {
+        index = constantCount++;
+        constants[index] = *operand;
+      }
+
+      if (index != -1)
+        constantUses[index]++;
+    }
+  }
+}
+
+// a constant goes to the pool only when its references are shorter than copies of it
+void choosePooledConstants()
+{
+  for (uint i = 0; i < constantCount; i++)
+  {
+    uint length = inlineLength(&constants[i]);
+    uint reference = varintLength(poolSize);
+    bool pooled = constantUses[i] * length > length + 1 + constantUses[i] * reference;
+
+    poolIndex[i] = pooled ? poolSize++ : -1;
+  }
+}
+
+void emitConstant(Operand *operand)
+{
+  emit(operand->type);
+
+  if (operand->type == vt_string)
+  {
+    for (byteref c = operand->data; *c; c++)
+      emit(*c);
+
+    emit(0);
+    return;
+  }
+
+  emitVarint(operand->number);
+}
+
+void emitOperand(Operand *operand)
+{
+  int index = findConstant(operand);
+
+  if (index != -1 && poolIndex[index] != -1)
+  {
+    emit(vt_constant);
+    emitVarint(poolIndex[index]);
+    return;
+  }
+
+  switch (operand->type)
+  {
+  case vt_null:
+    emit(vt_null);
+    break;
+
+  case vt_byte:
+  case vt_pin:
+  case vt_identifier:
+    emit(operand->type);
+    emit(operand->number);
+    break;
+
+  case vt_blob:
+  {
+    uint size = _decodeInteger(operand->data);
+    emit(vt_blob);
+    emitVarint(size);
+
+    for (uint i = 0; i < size; i++)
+      emit(operand->data[4 + i]);
+
+    break;
+  }
+
+  default:
+    emitConstant(operand);
+  }
+}
+
+// Write the code section with the current guess of where each instruction starts,
+// and return its length. Offsets only grow, so repeating this converges
+uint emitCode(uint *offsets)
+{
+  uint start = outputLength;
+  uint *next = (uint *)calloc(source.instructionCount + 1, sizeof(uint));
+
+  for (uint i = 0; i < source.instructionCount; i++)
+  {
+    Instruction *instruction = &source.code[i];
+    const char *signature = _signatureOf(instruction->opcode);
+
+    next[i] = outputLength - start;
+    emit(instruction->opcode);
+
+    for (int j = 0; signature[j]; j++)
+    {
+      Operand operand = instruction->operands[j];
+
+      if (signature[j] == 'T')
+        operand.number = offsets[operand.number];
+
+      if (signature[j] == 'L')
+        operand.number = offsets[operand.number] - offsets[i + 1];
+
+      if (signature[j] == 'T' || signature[j] == 'L')
+      {
+        emit(operand.type);
+        emitVarint(operand.number);
+        continue;
+      }
+
+      emitOperand(&operand);
+    }
+  }
+
+  next[source.instructionCount] = outputLength - start;
+
+  for (uint i = 0; i <= source.instructionCount; i++)
+  {
+    offsets[i] = next[i];
+  }
+
+  free(next);
+  return outputLength - start;
+}
+
+void pack()
+{
+  uint *offsets = (uint *)calloc(source.instructionCount + 1, sizeof(uint));
+  uint *previous = (uint *)calloc(source.instructionCount + 1, sizeof(uint));
+  uint functionCount = 0;
+  uint codeLength;
+  uint i;
+
+  collectConstants();
+  choosePooledConstants();
+
+  do
+  {
+    memcpy(previous, offsets, (source.instructionCount + 1) * sizeof(uint));
+    outputLength = 0;
+    codeLength = emitCode(offsets);
+  } while (memcmp(previous, offsets, (source.instructionCount + 1) * sizeof(uint)));
+
+  outputLength = 0;
+  emit(0);
+  emit('E');
+  emit('S');
+  emit(PACKED_PROGRAM_VERSION);
+
+  emitVarint(poolSize);
+
+  for (i = 0; i < constantCount; i++)
+  {
+    if (poolIndex[i] != -1)
+      emitConstant(&constants[i]);
+  }
+
+  for (i = 0; i < source.instructionCount; i++)
+  {
+    if (source.code[i].opcode == op_define)
+      functionCount++;
+  }
+
+  emitVarint(functionCount);
+
+  for (i = 0; i < source.instructionCount; i++)
+  {
+    if (source.code[i].opcode == op_define)
+      emitVarint(offsets[i + 1]);
+  }
+
+  emitVarint(codeLength);
+  emitCode(offsets);
+
+  free(offsets);
+  free(previous);
+}
+
+bool sameOperand(Operand *a, Operand *b)
+{
+  if (a->type == vt_blob || b->type == vt_blob)
+    return a->type == b->type;
+
+  return sameConstant(a, b);
+}
+
+// decode the packed program again and compare it with the original
+bool check()
+{
+  program_decode(&packed, output, outputLength);
+
+  if (!packed.verified || packed.instructionCount != source.instructionCount)
+    return false;
+
+  for (uint i = 0; i < source.instructionCount; i++)
+  {
+    if (packed.code[i].opcode != source.code[i].opcode)
+      return false;
+
+    for (int j = 0; j < MAX_OPERANDS; j++)
+    {
+      if (!sameOperand(&packed.code[i].operands[j], &source.code[i].operands[j]))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+void put(byte b)
+{
+  compressed[compressedLength++] = b;
+}
+
+// LZSS with the longest match of the window, for the streaming decoder of uploads
+void compress()
+{
+  uint flags = 0;
+  uint tokens = 8;
+  uint i = 0;
+  uint value = outputLength;
+
+  put(0);
+  put('L');
+  put('Z');
+
+  for (; value >= 0x80; value >>= 7)
+    put((value & 0x7f) | 0x80);
+
+  put(value);
+
+  while (i < outputLength)
+  {
+    uint bestLength = 0;
+    uint bestDistance = 0;
+
+    if (tokens == 8)
+    {
+      flags = compressedLength;
+      tokens = 0;
+      put(0);
+    }
+
+    for (uint distance = 1; distance <= i && distance <= LZ_WINDOW; distance++)
+    {
+      uint length = 0;
+
+      while (length < LZ_MAX_MATCH && i + length < outputLength && output[i + length] == output[i + length - distance])
+        length++;
+
+      if (length > bestLength)
+      {
+        bestLength = length;
+        bestDistance = distance;
+      }
+    }
+
+    if (bestLength >= LZ_MIN_MATCH)
+    {
+      compressed[flags] |= 1 << tokens;
+      put((bestDistance - 1) >> 4);
+      put((bestDistance - 1) << 4 | (bestLength - LZ_MIN_MATCH));
+      i += bestLength;
+    }
+    else
+    {
+      put(output[i++]);
+    }
+
+    tokens++;
+  }
+}
+
+// decompress it again like an upload, and compare it with the packed program
+bool checkCompressed()
+{
+  Upload upload = {};
+  bool same;
+
+  upload_start(&upload, 0, compressedLength);
+  upload_write(&upload, compressed, compressedLength);
+  same = upload_done(&upload) && !upload.failed && upload.length == outputLength &&
+         upload.received == outputLength && memcmp(upload.bytes, output, outputLength) == 0;
+  upload_cancel(&upload);
+  return same;
+}
+
+byteref readFile(const char *fileName, long *length)
+{
+  FILE *file = fopen(fileName, "r");
+
+  if (file == NULL)
+  {
+    perror("Error in opening file");
+    return nullptr;
+  }
+
+  fseek(file, 0L, SEEK_END);
+  *length = ftell(file);
+  rewind(file);
+  byteref buffer = (byteref)malloc(*length);
+  fread(buffer, 1, *length, file);
+  fclose(file);
+  return buffer;
+}
+
+int main(int argc, char **argv)
+{
+  long length;
+  bool compressing = argc > 1 && !strcmp(argv[1], "-z");
+
+  if (compressing)
+  {
+    argc--;
+    argv++;
+  }
+
+  if (argc < 3)
+  {
+    printf("Usage:\n  pack [-z] path/to/program.bin path/to/packed.bin\n");
+    return -1;
+  }
+
+  byteref buffer = readFile(argv[1], &length);
+
+  if (buffer == nullptr)
+    return -1;
+
+  program_decode(&source, buffer, length);
+
+  if (!source.verified || source.version != 1)
+  {
+    printf("%s is not a valid v1 program\n", argv[1]);
+    return -3;
+  }
+
+  pack();
+
+  if (outputLength > MAX_PACKED_SIZE || !check())
+  {
+    printf("%s: packed program does not match the original\n", argv[1]);
+    return -4;
+  }
+
+  if (compressing)
+  {
+    compress();
+
+    if (!checkCompressed())
+    {
+      printf("%s: compressed program does not match the packed one\n", argv[1]);
+      return -4;
+    }
+  }
+
+  FILE *file = fopen(argv[2], "w");
+  fwrite(compressing ? compressed : output, 1, compressing ? compressedLength : outputLength, file);
+  fclose(file);
+
+  printf("%s: %ld bytes, %d packed (%.0f%%), %d instructions\n", argv[1], length, outputLength,
+         outputLength * 100.0 / length, source.instructionCount);
+
+  if (compressing)
+    printf("%s: %d compressed (%.0f%%)\n", argv[1], compressedLength, compressedLength * 100.0 / length);
+
+  free(buffer);
+  return 0;
+}
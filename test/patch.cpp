@@ -0,0 +1,228 @@
+#define WITH_OPTIMIZER
+#define WITH_PATCH
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include "emit.hpp"
+#include <stdio.h>
+
+// Patches a function of a running program and checks that the calls after the patch
+// run the new code, with the slots the old code left:
+//
+//   patch
+//
+// The program counts in a loop, calling a function that prints the count, and prints
+// slot 4 after the call. Slot 4 is declared once, and only the new function changes it.
+// The old function starts with a noop and a goto, which the optimizer would remove and
+// send the call past. Patches that are not valid must leave it running as it was.
+
+// the function a patch replaces, and where its code starts
+void emitHeader(uint function, uint start)
+{
+  emitWord(function);
+  emitWord(start);
+}
+
+// print "<label> count <count> " with the count in slot 0, the label in slot 1 and " count " in slot 2
+void emitCount(const char *label)
+{
+  emit(op_addto);
+  emitSlot(0);
+  emitInteger(1);
+
+  emit(op_assign);
+  emitSlot(1);
+  emitString(label);
+
+  emit(op_print);
+  emitSlot(1);
+
+  emit(op_print);
+  emitSlot(2);
+
+  emit(op_print);
+  emitSlot(0);
+
+  emit(op_print);
+  emitString(" ");
+
+  emit(op_return);
+}
+
+// Bytes of a patch in `bytes` after `start`, applied through an upload in 3 byte segments
+bool patch(int start)
+{
+  Upload upload = {};
+  int patchLength = length - start;
+
+  if (!upload_start(&upload, 0, patchLength))
+    return false;
+
+  upload.patch = true;
+
+  for (int i = 0; i < patchLength; i += 3)
+  {
+    upload_write(&upload, bytes + start + i, patchLength - i < 3 ? patchLength - i : 3);
+  }
+
+  return upload_finish(&upload);
+}
+
+// The patches come while the program runs, like a request to the firmware:
+// two that are not valid, then the new function
+void onPatchTimer(void *arg)
+{
+  uint *offsets = (uint *)arg;
+  uint function = offsets[0];
+  uint end = offsets[1];
+
+  // not after the end of the program
+  length = end;
+  emitHeader(function, end);
+  emitCount("new");
+
+  if (patch(end))
+  {
+    printf("A patch for another version of the program was applied\n");
+    exit(1);
+  }
+
+  // a jump into the middle of an instruction
+  length = end;
+  emitHeader(function, end + 1);
+  emit(op_goto);
+  emitTarget(function + 2);
+
+  if (patch(end))
+  {
+    printf("A patch with an invalid jump was applied\n");
+    exit(1);
+  }
+
+  length = end;
+  emitHeader(function, end + 1);
+  emit(op_assign);
+  emitSlot(4);
+  emitInteger(7);
+  emitCount("new");
+
+  if (!patch(end))
+  {
+    printf("The patch was not applied\n");
+    exit(1);
+  }
+}
+
+// Every line is "old" or "new", all old ones first, counting up from 1 without a gap,
+// and ends with the 5 slot 4 was declared with, or the 7 the new function set
+bool check(int *oldLines, int *newLines)
+{
+  int expected = 1;
+  char label[8];
+  int count;
+  int value;
+  int read;
+  char *line = output;
+
+  *oldLines = 0;
+  *newLines = 0;
+  output[outputLength] = 0;
+
+  while (sscanf(line, "%7s count %d %d\n%n", label, &count, &value, &read) == 3)
+  {
+    bool isNew = strcmp(label, "new") == 0;
+
+    if (count != expected++ || (!isNew && strcmp(label, "old") != 0) || (!isNew && *newLines))
+      return false;
+
+    if (value != (isNew ? 7 : 5))
+      return false;
+
+    *oldLines += !isNew;
+    *newLines += isNew;
+    line += read;
+  }
+
+  return *line == 0;
+}
+
+int main(int argc, char **argv)
+{
+  Program *program = scheduler_task(0);
+  Timer patchTimer;
+  uint loop;
+  uint call;
+  uint offsets[2];
+  int oldLines;
+  int newLines;
+
+  scheduler_setup(&collect, nullptr);
+
+  emit(op_declare);
+  emitSlot(0);
+  emitInteger(0);
+
+  emit(op_assign);
+  emitSlot(2);
+  emitString(" count ");
+
+  emit(op_declare);
+  emitSlot(4);
+  emitInteger(5);
+
+  // the function comes after the loop, and the call is pointed at it below
+  loop = length;
+  call = length;
+  emit(op_jumpto);
+  emitTarget(0);
+
+  emit(op_print);
+  emitSlot(4);
+
+  emit(op_print);
+  emitString("\n");
+
+  emit(op_delay);
+  emitInteger(10);
+
+  emit(op_goto);
+  emitTarget(loop);
+
+  offsets[0] = length;
+  emit(op_noop);
+
+  emit(op_goto);
+  emitTarget(length + 5 + 10);
+
+  emit(op_print);
+  emitString("skipped");
+
+  emitCount("old");
+  offsets[1] = length;
+
+  length = call + 1;
+  emitTarget(offsets[0]);
+  length = offsets[1];
+
+  if (!scheduler_load(0, bytes, length))
+  {
+    printf("The program to patch is not valid\n");
+    return 1;
+  }
+
+  os_timer_setfn(&patchTimer, &onPatchTimer, offsets);
+  os_timer_arm(&patchTimer, 95, 0);
+  mock_run(0, 195);
+  program->flush();
+  fwrite(output, 1, outputLength, stdout);
+
+  if (!check(&oldLines, &newLines) || !oldLines || !newLines)
+  {
+    printf("Output does not switch from the old function to the new one\n");
+    return 1;
+  }
+
+  printf("Patched after %d calls, %d calls to the new function\n", oldLines, newLines);
+  return 0;
+}
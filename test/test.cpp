@@ -1,29 +1,60 @@
 #define WITH_DEBUG
+#define WITH_OPTIMIZER
 #define SERIAL_SPEED 115200
 
 #include "espmock.hpp"
 #include "vm.hpp"
 #include <stdio.h>
 
-static Program program;
-
-void onSend(char *bytes, int length)
+bool onSend(char *bytes, int length)
 {
   fwrite(bytes, 1, length, stdout);
+  return true;
 }
 
-int main(int argc, char **argv)
+#ifdef WITH_PROFILER
+// collapsed stacks go to the file in PROFILE, or profile.folded
+void saveProfile()
 {
-  program.onSend = &onSend;
+  const char *fileName = getenv("PROFILE") ? getenv("PROFILE") : "profile.folded";
+  FILE *profileFile = fopen(fileName, "w");
+  Report report = {};
+
+  if (profileFile == NULL)
+  {
+    perror("Error writing profile");
+    return;
+  }
 
-  char *fileName = argv[1];
+  profiler_printTasks(&report);
+  fwrite(report.bytes, 1, report.length, profileFile);
+  report_free(&report);
+  fclose(profileFile);
+  printf("\nProfile saved to %s\n", fileName);
+}
+#endif
 
-  if (argc < 2 || !strlen(fileName))
+// Upload a program into a task like the firmware does, in TCP segments of
+// UPLOAD_SEGMENT bytes, 1460 by default
+bool upload(int task, unsigned char *buffer, long length)
+{
+  Upload upload = {};
+  long segment = getenv("UPLOAD_SEGMENT") ? atol(getenv("UPLOAD_SEGMENT")) : 1460;
+
+  if (!upload_start(&upload, task, length))
+    return false;
+
+  for (long i = 0; i < length; i += segment)
   {
-    printf("No file to run!\n\nUsage:\n  vm path/to/file.bin\n");
-    return -1;
+    upload_write(&upload, buffer + i, length - i < segment ? length - i : segment);
   }
 
+  return upload_finish(&upload);
+}
+
+// Load a program from a file into a task
+int load(int task, char *fileName)
+{
   printf("Running %s\n", fileName);
 
   FILE *file;
@@ -51,8 +82,80 @@ int main(int argc, char **argv)
 
   fread(buffer, sizeof(char), length, file);
   fclose(file);
-  program_load(&program, buffer, length);
+
+  if (!upload(task, buffer, length))
+  {
+    free(buffer);
+    return -3;
+  }
+
+#ifdef WITH_STORE
+  // the next run without files starts it from the store, like the chip after a restart
+  Program *program = scheduler_task(task);
+  store_save(program->image, program->imageLength);
+  store_autostart(task, store_hash(program->image, program->imageLength));
+#endif
+
   free(buffer);
+  return 0;
+}
 
-  vm_tick(&program);
-}
\ No newline at end of file
+// Each file runs in its own task, on the virtual clock of espmock.hpp
+int main(int argc, char **argv)
+{
+  int i = 1;
+  int error;
+
+#ifdef WITH_STORE
+  store_open();
+
+  if (argc < 2)
+  {
+    printf("Running the programs of the store\n");
+    scheduler_setup(&onSend, nullptr);
+    store_boot();
+    mock_loop();
+    return 0;
+  }
+#endif
+
+  if (argc < 2 || !strlen(argv[1]))
+  {
+    printf("No file to run!\n\nUsage:\n  vm path/to/file.bin [more/files.bin]\n");
+    return -1;
+  }
+
+  if (argc - 1 > MAX_TASKS)
+  {
+    printf("At most %d programs can run at once\n", MAX_TASKS);
+    return -1;
+  }
+
+  scheduler_setup(&onSend, nullptr);
+
+  for (; i < argc; i++)
+  {
+    error = load(i - 1, argv[i]);
+
+    if (error)
+      return error;
+  }
+
+#ifdef WITH_PROFILER
+  profiler_start(PROFILE_INTERVAL);
+  mock_loop();
+  profiler_stop();
+  saveProfile();
+#else
+  mock_loop();
+#endif
+
+#ifdef WITH_STATS
+  // what GET /stats answers on the chip
+  Report report = {};
+  scheduler_printStats(&report);
+  fwrite(report.bytes, 1, report.length, stdout);
+  report_free(&report);
+#endif
+  return 0;
+}
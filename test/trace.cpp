@@ -0,0 +1,151 @@
+#define SERIAL_SPEED 115200
+#define WITH_TRACE
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include <stdio.h>
+
+// Turns the output of a program built with WITH_TRACE back into text:
+//
+//   bin/vm-trace program.bin | trace [-t]
+//
+// Text passes through, trace frames are formatted like _debug would.
+// With -t, each line of a trace starts with the time in ms and the offset of its instruction
+
+static char *formats[256];
+static bool showTime = false;
+static bool atLineStart = true;
+
+bool readBytes(void *buffer, size_t length)
+{
+  return fread(buffer, 1, length, stdin) == length;
+}
+
+void printText(const char *text)
+{
+  for (; *text; text++)
+  {
+    putchar(*text);
+    atLineStart = *text == '\n';
+  }
+}
+
+// the conversions of Program::printf
+void printRecord(TraceRecord *record)
+{
+  const char *format = formats[record->format];
+  char text[32];
+  int argument = 0;
+
+  if (format == nullptr)
+  {
+    printf("[!] trace record without format at %d\n", record->offset);
+    atLineStart = true;
+    return;
+  }
+
+  if (showTime && atLineStart)
+  {
+    printf("%10.3f @%-5d ", record->time / 1000.0, record->offset);
+  }
+
+  for (const char *c = format; *c; c++)
+  {
+    if (*c != '%')
+    {
+      text[0] = *c;
+      text[1] = 0;
+      printText(text);
+      continue;
+    }
+
+    if (!*++c)
+      break;
+
+    uint32 value = argument < record->argumentCount ? record->arguments[argument] : 0;
+
+    switch (*c)
+    {
+    case 'd':
+      sprintf(text, "%d", (int)value);
+      argument++;
+      break;
+    case 'x':
+      sprintf(text, "%02x", value);
+      argument++;
+      break;
+    case 'c':
+      sprintf(text, "%c", value);
+      argument++;
+      break;
+    case 's':
+      sprintf(text, "?");
+      argument++;
+      break;
+    case 'p':
+      sprintf(text, "p");
+      argument++;
+      break;
+    default:
+      sprintf(text, "%c", *c);
+    }
+
+    printText(text);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int c;
+  byte header[3];
+  byte *payload = (byte *)malloc(65536);
+
+  showTime = argc > 1 && !strcmp(argv[1], "-t");
+
+  while ((c = getchar()) != EOF)
+  {
+    if (c != 0)
+    {
+      putchar(c);
+      atLineStart = c == '\n';
+      continue;
+    }
+
+    if (!readBytes(header, 3))
+      break;
+
+    uint length = header[1] | header[2] << 8;
+
+    if (!readBytes(payload, length))
+      break;
+
+    switch (header[0])
+    {
+    case TRACE_FRAME_FORMAT:
+      free(formats[payload[0]]);
+      formats[payload[0]] = strndup((char *)payload + 1, length - 1);
+      break;
+
+    case TRACE_FRAME_RECORDS:
+      for (uint i = 0; i + sizeof(TraceRecord) <= length; i += sizeof(TraceRecord))
+      {
+        TraceRecord record;
+        memcpy(&record, payload + i, sizeof(TraceRecord));
+        printRecord(&record);
+      }
+      break;
+
+    case TRACE_FRAME_LOST:
+    {
+      uint32 lost;
+      memcpy(&lost, payload, sizeof(uint32));
+      printf("%s[!] %d trace records lost\n", atLineStart ? "" : "\n", lost);
+      atLineStart = true;
+      break;
+    }
+    }
+  }
+
+  free(payload);
+  return 0;
+}
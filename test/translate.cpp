@@ -0,0 +1,396 @@
+#define WITH_DEBUG
+#define WITH_OPTIMIZER
+#define SERIAL_SPEED 115200
+
+#include "espmock.hpp"
+#include "vm.hpp"
+#include <stdio.h>
+
+// Translates a program into C++ for host simulation.
+// Every instruction becomes a label that calls the same handler as the interpreter,
+// and jumps to known targets become plain gotos, so there is no dispatch loop left.
+// Arithmetic and jumps on integers also get an inline path, used while debug is off.
+// The generated program decodes the same bytes at startup and runs on the same
+// records, so the handlers see exactly the operands they see in bin/vm
+
+static Program program;
+
+// how the interpreter runs each opcode, as in vm_next
+const char *_handlerOf(byte opcode)
+{
+  switch (opcode)
+  {
+  case op_noop:
+    return "";
+  case op_halt:
+    return "vm_halt(p);";
+  case op_define:
+    return "p->counter = _readOperand(p)->number;";
+  case op_restart:
+    return "os_restart();";
+  case op_debug:
+    return "vm_toggleDebug(p);";
+  case op_systeminfo:
+    return "vm_systemInformation(p);";
+  case op_stats:
+    return "vm_printStats(p);";
+  case op_sleep:
+    return "vm_sleep(p);";
+  case op_print:
+    return "_printValue(p, _readValue(p));";
+  case op_dump:
+    return "vm_dump(p);";
+  case op_declare:
+    return "vm_declareReference(p);";
+  case op_memget:
+    return "vm_readFromMemory(p);";
+  case op_memset:
+    return "vm_writeToMemory(p);";
+  case op_iowrite:
+    return "vm_ioWrite(p);";
+  case op_ioread:
+    return "vm_ioRead(p);";
+  case op_iomode:
+    return "vm_ioMode(p);";
+  case op_iotype:
+    return "vm_ioType(p);";
+  case op_ioallout:
+    return "vm_ioAllOut(p);";
+  case op_iointerrupt:
+    return "vm_ioInterrupt(p);";
+  case op_iointerruptToggle:
+    return "vm_ioInterruptToggle(p);";
+  case op_delay:
+    return "vm_delay(p);";
+  case op_yield:
+    return "vm_yield(p);";
+  case op_jumpto:
+    return "vm_jumpTo(p);";
+  case op_jumpif:
+    return "vm_jumpIf(p);";
+  case op_goto:
+    return "vm_goto(p);";
+  case op_gotoif:
+    return "vm_gotoIf(p);";
+  case op_return:
+    return "vm_return(p);";
+  case op_gt:
+    return "vm_binaryOperation(p, op_gt);";
+  case op_gte:
+    return "vm_binaryOperation(p, op_gte);";
+  case op_lt:
+    return "vm_binaryOperation(p, op_lt);";
+  case op_lte:
+    return "vm_binaryOperation(p, op_lte);";
+  case op_equal:
+    return "vm_binaryOperation(p, op_equal);";
+  case op_notequal:
+    return "vm_binaryOperation(p, op_notequal);";
+  case op_xor:
+    return "vm_binaryOperation(p, op_xor);";
+  case op_and:
+    return "vm_binaryOperation(p, op_and);";
+  case op_or:
+    return "vm_binaryOperation(p, op_or);";
+  case op_add:
+    return "vm_binaryOperation(p, op_add);";
+  case op_sub:
+    return "vm_binaryOperation(p, op_sub);";
+  case op_mul:
+    return "vm_binaryOperation(p, op_mul);";
+  case op_div:
+    return "vm_binaryOperation(p, op_div);";
+  case op_mod:
+    return "vm_binaryOperation(p, op_mod);";
+  case op_inc:
+    return "vm_unaryOperation(p, op_inc);";
+  case op_dec:
+    return "vm_unaryOperation(p, op_dec);";
+  case op_jumpgt:
+    return "vm_compareAndJump(p, op_jumpgt);";
+  case op_jumpgte:
+    return "vm_compareAndJump(p, op_jumpgte);";
+  case op_jumplt:
+    return "vm_compareAndJump(p, op_jumplt);";
+  case op_jumplte:
+    return "vm_compareAndJump(p, op_jumplte);";
+  case op_jumpequal:
+    return "vm_compareAndJump(p, op_jumpequal);";
+  case op_jumpnotequal:
+    return "vm_compareAndJump(p, op_jumpnotequal);";
+  case op_incjumplt:
+    return "vm_incrementAndJump(p);";
+  case op_addto:
+    return "vm_addToSlot(p);";
+  case op_not:
+    return "vm_notOperation(p);";
+  case op_assign:
+    return "vm_assignOperation(p);";
+  case op_wifistatus:
+    return "vm_printStationStatus(p);";
+  case op_wifiap:
+    return "vm_startAccessPoint(p);";
+  case op_wificonnect:
+    return "vm_wifiConnect(p);";
+  case op_wifidisconnect:
+    return "vm_wifiDisconnect(p);";
+  case op_wifilist:
+    return "vm_wifiList(p);";
+  case op_i2csetup:
+    return "vm_i2csetup(p);";
+  case op_i2cstart:
+    return "vm_i2cstart(p);";
+  case op_i2cstop:
+    return "vm_i2cstop(p);";
+  case op_i2cwrite:
+    return "vm_i2cwrite(p);";
+  case op_i2cread:
+    return "vm_i2cread(p);";
+  case op_i2cfind:
+    return "vm_i2cfind(p);";
+  }
+
+  return "vm_invalidOperation(p);";
+}
+
+// C++ expression for the integer value of a numeric operand, or nullptr for strings and blobs
+const char *integerOf(Operand *operand, char *buffer)
+{
+  if (operand->type == vt_string || operand->type == vt_blob)
+    return nullptr;
+
+  if (operand->type == vt_identifier)
+    sprintf(buffer, "p->slots[%d].toInteger()", operand->number);
+  else
+    sprintf(buffer, "%uu", operand->number);
+
+  return buffer;
+}
+
+// Arithmetic and jumps run inline while debug output is off.
+// They call the same helpers as their handlers, so slots end with the same values
+bool translateFastPath(FILE *out, uint position)
+{
+  Instruction *instruction = &program.code[position];
+  Operand *operands = instruction->operands;
+  byte opcode = instruction->opcode;
+  char a[32];
+  char b[32];
+  uint next = position + 1;
+
+  if (opcode >= op_gt && opcode <= op_mod)
+  {
+    if (!integerOf(&operands[1], a) || !integerOf(&operands[2], b))
+      return false;
+
+    fprintf(out, "  if (FAST)\n  {\n");
+    fprintf(out, "    _updateSlotWithInteger(p, %d, _operate(%d, %s, %s));\n", operands[0].number, opcode, a, b);
+    fprintf(out, "    goto i%d;\n  }\n", next);
+    return true;
+  }
+
+  if (opcode >= op_jumpgt && opcode <= op_jumpnotequal)
+  {
+    if (!integerOf(&operands[0], a) || !integerOf(&operands[1], b))
+      return false;
+
+    fprintf(out, "  if (FAST)\n  {\n");
+    fprintf(out, "    if (_operate(%d, %s, %s))\n", opcode - op_jumpgt + op_gt, a, b);
+    fprintf(out, "      goto i%d;\n", operands[2].number);
+    fprintf(out, "    goto i%d;\n  }\n", next);
+    return true;
+  }
+
+  switch (opcode)
+  {
+  case op_inc:
+  case op_dec:
+    fprintf(out, "  if (FAST)\n  {\n");
+    fprintf(out, "    _updateSlotWithInteger(p, %d, p->slots[%d].toInteger() %s 1);\n", operands[0].number,
+            operands[0].number, opcode == op_inc ? "+" : "-");
+    fprintf(out, "    goto i%d;\n  }\n", next);
+    return true;
+
+  case op_addto:
+    if (!integerOf(&operands[1], b))
+      return false;
+
+    fprintf(out, "  if (FAST)\n  {\n");
+    fprintf(out, "    _updateSlotWithInteger(p, %d, p->slots[%d].toInteger() + %s);\n", operands[0].number,
+            operands[0].number, b);
+    fprintf(out, "    goto i%d;\n  }\n", next);
+    return true;
+
+  case op_incjumplt:
+    if (!integerOf(&operands[1], b))
+      return false;
+
+    fprintf(out, "  if (FAST)\n  {\n");
+    fprintf(out, "    uint value = p->slots[%d].toInteger() + 1;\n", operands[0].number);
+    fprintf(out, "    _updateSlotWithInteger(p, %d, value);\n", operands[0].number);
+    fprintf(out, "    if (value < %s)\n      goto i%d;\n", b, operands[2].number);
+    fprintf(out, "    goto i%d;\n  }\n", next);
+    return true;
+
+  case op_goto:
+    fprintf(out, "  if (FAST)\n    goto i%d;\n", operands[0].number);
+    return true;
+  }
+
+  return false;
+}
+
+void translateInstruction(FILE *out, uint position)
+{
+  Instruction *instruction = &program.code[position];
+  const char *signature = _signatureOf(instruction->opcode);
+  int target = -1;
+
+  for (int j = 0; signature && signature[j]; j++)
+  {
+    if (signature[j] == 'T' || signature[j] == 'L')
+      target = instruction->operands[j].number;
+  }
+
+  fprintf(out, "i%d: // %d\n", position, instruction->offset);
+  fprintf(out, "  CHARGE(%d);\n", position);
+  translateFastPath(out, position);
+  fprintf(out, "  STEP(%d);\n", position);
+  fprintf(out, "  %s\n", _handlerOf(instruction->opcode));
+
+  switch (instruction->opcode)
+  {
+  case op_halt:
+    fprintf(out, "  return budget;\n");
+    return;
+
+  case op_define:
+  case op_goto:
+    fprintf(out, "  goto i%d;\n", target);
+    return;
+
+  case op_return:
+    fprintf(out, "  RESUME();\n");
+    return;
+  }
+
+  fprintf(out, "  CONTINUE();\n");
+
+  if (target != -1)
+    fprintf(out, "  if (p->counter == %d)\n    goto i%d;\n", target, target);
+}
+
+void translate(FILE *out, const char *fileName, byteref bytes, long length)
+{
+  uint i;
+
+  fprintf(out, "// Generated by test/translate.cpp from %s\n", fileName);
+  fprintf(out, "#define WITH_DEBUG\n#define WITH_OPTIMIZER\n#define SERIAL_SPEED 115200\n\n");
+  fprintf(out, "#include \"espmock.hpp\"\n#include \"vm.hpp\"\n#include <stdio.h>\n\n");
+  fprintf(out, "#define INSTRUCTION_COUNT %d\n\n", program.instructionCount);
+
+  fprintf(out, "#define STEP(position)                 \\\n");
+  fprintf(out, "  p->instruction = &p->code[position]; \\\n");
+  fprintf(out, "  p->operandCursor = 0;                \\\n");
+  fprintf(out, "  p->counter = position + 1;\n\n");
+  fprintf(out, "#define CONTINUE()                     \\\n");
+  fprintf(out, "  if (p->delayTime || p->paused)       \\\n");
+  fprintf(out, "    return budget;\n\n");
+  fprintf(out, "#define CHARGE(position)               \\\n");
+  fprintf(out, "  if (budget-- == 0)                   \\\n");
+  fprintf(out, "  {                                    \\\n");
+  fprintf(out, "    p->counter = position;             \\\n");
+  fprintf(out, "    vm_preempt(p);                     \\\n");
+  fprintf(out, "    return 0;                          \\\n");
+  fprintf(out, "  }\n\n");
+  fprintf(out, "#define FAST !p->debug\n\n");
+  fprintf(out, "#define RESUME() \\\n");
+  fprintf(out, "  CONTINUE();    \\\n");
+  fprintf(out, "  goto *labels[p->counter];\n\n");
+
+  fprintf(out, "static Program program;\n");
+  fprintf(out, "static unsigned char bytes[%ld] = {", length);
+
+  for (i = 0; i < (uint)length; i++)
+  {
+    fprintf(out, "%s0x%02x", i == 0 ? "\n  " : i % 16 ? ", " : ",\n  ", bytes[i]);
+  }
+
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "uint native_slice(Program *p, uint budget)\n{\n");
+  fprintf(out, "  static void *labels[] = {");
+
+  for (i = 0; i <= program.instructionCount; i++)
+  {
+    fprintf(out, "%s&&i%d", i == 0 ? "\n    " : i % 8 ? ", " : ",\n    ", i);
+  }
+
+  fprintf(out, "};\n\n");
+  fprintf(out, "  goto *labels[p->counter];\n\n");
+
+  for (i = 0; i <= program.instructionCount; i++)
+  {
+    translateInstruction(out, i);
+  }
+
+  fprintf(out, "}\n\n");
+
+  fprintf(out, "void native_run(Program *p)\n{\n");
+  fprintf(out, "  uint budget = p->instructionBudget;\n");
+  fprintf(out, "  p->instructionsRun += budget - native_slice(p, budget);\n}\n\n");
+
+  fprintf(out, "void native_tick(void *p)\n{\n  _tick((Program *)p, &native_run);\n}\n\n");
+
+  fprintf(out, "bool onSend(char *bytes, int length)\n{\n  fwrite(bytes, 1, length, stdout);\n  return true;\n}\n\n");
+
+  fprintf(out, "int main(int argc, char **argv)\n{\n");
+  fprintf(out, "  program.onSend = &onSend;\n");
+  fprintf(out, "  printf(\"Running %s\\n\");\n", fileName);
+  fprintf(out, "  program_decode(&program, bytes, sizeof(bytes));\n\n");
+  fprintf(out, "  if (!program.verified || program.instructionCount != INSTRUCTION_COUNT)\n  {\n");
+  fprintf(out, "    printf(\"Program does not match its translation\\n\");\n    return -3;\n  }\n\n");
+  fprintf(out, "  os_timer_disarm(&program.timer);\n");
+  fprintf(out, "  os_timer_setfn(&program.timer, &native_tick, &program);\n");
+  fprintf(out, "  os_timer_arm(&program.timer, 1, 0);\n");
+  fprintf(out, "  mock_loop();\n  return 0;\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3)
+  {
+    printf("Usage:\n  translate path/to/program.bin path/to/program.cpp\n");
+    return -1;
+  }
+
+  FILE *file = fopen(argv[1], "r");
+
+  if (file == NULL)
+  {
+    perror("Error in opening file");
+    return -1;
+  }
+
+  fseek(file, 0L, SEEK_END);
+  long length = ftell(file);
+  rewind(file);
+  byteref buffer = (byteref)malloc(length);
+  fread(buffer, 1, length, file);
+  fclose(file);
+
+  program_decode(&program, buffer, length);
+
+  if (!program.verified)
+  {
+    printf("%s is not a valid program\n", argv[1]);
+    free(buffer);
+    return -3;
+  }
+
+  FILE *out = fopen(argv[2], "w");
+  translate(out, argv[1], buffer, length);
+  fclose(out);
+  free(buffer);
+  return 0;
+}